@@ -1,6 +1,7 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "index_memory.h"
 #include "hnswlib.h"
 #include <atomic>
 #include <random>
@@ -29,6 +30,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
  public:
     static const tableint MAX_LABEL_OPERATION_LOCKS = 65536;
     static const unsigned char DELETE_MARK = 0x01;
+    static const tableint LINK_LIST_LOCK_STRIPES = 65536;
 
     size_t max_elements_{0};
     mutable std::atomic<size_t> cur_element_count{0};  // current number of elements
@@ -50,7 +52,8 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     mutable std::vector<std::mutex> label_op_locks_;
 
     std::mutex global;
-    std::vector<std::mutex> link_list_locks_;
+    // Link list locks, striped by element id - see getLinkListMutex()
+    mutable std::vector<std::mutex> link_list_locks_;
 
     tableint enterpoint_node_{0};
 
@@ -59,6 +62,20 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
     char *data_level0_memory_{nullptr};
     char **linkLists_{nullptr};
+
+    // Level 0 links, vectors and labels - in data_level0_memory_ records, or
+    // in 3 separate arrays with the split layout
+    bool split_layout_{false};
+    char *links_level0_memory_{nullptr};
+    char *vector_memory_{nullptr};
+    char *label_memory_{nullptr};
+    size_t links_stride_{0}, vector_stride_{0}, label_stride_{0};
+
+    // Huge pages/NUMA placement of the level 0 arrays
+    std::shared_ptr<IndexMemory> memory_{std::make_shared<IndexMemory>()};
+
+    // Upper level link lists, linkLists_[i] points into the arena
+    std::unique_ptr<LinkListArena> link_arena_;
     std::vector<int> element_levels_;  // keeps level of each element
 
     size_t data_size_{0};
@@ -80,10 +97,13 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     std::mutex deleted_elements_lock;  // lock for deleted_elements
     std::unordered_set<tableint> deleted_elements;  // contains internal ids of deleted elements
 
+    size_t reordered_element_count_{0};  // cur_element_count at the last reorderNodes()
+
     #include "hnswdisk.i"
 
 
-    HierarchicalDiskNSW(SpaceInterface<dist_t> *s) {
+    HierarchicalDiskNSW(SpaceInterface<dist_t> *s)
+        : link_arena_(new LinkListArena(memory_)) {
     }
 
 
@@ -92,8 +112,12 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         const std::string &location,
         bool nmslib = false,
         size_t max_elements = 0,
-        bool allow_replace_deleted = false)
+        bool allow_replace_deleted = false,
+        std::shared_ptr<IndexMemory> memory = nullptr)
         : allow_replace_deleted_(allow_replace_deleted) {
+        if (memory)
+            memory_ = memory;
+        link_arena_.reset(new LinkListArena(memory_));
         loadIndex(location, s, max_elements);
     }
 
@@ -104,11 +128,17 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         size_t M = 16,
         size_t ef_construction = 200,
         size_t random_seed = 100,
-        bool allow_replace_deleted = false)
+        bool allow_replace_deleted = false,
+        bool split_layout = false,
+        std::shared_ptr<IndexMemory> memory = nullptr)
         : label_op_locks_(MAX_LABEL_OPERATION_LOCKS),
-            link_list_locks_(max_elements),
+            link_list_locks_(LINK_LIST_LOCK_STRIPES),
+            split_layout_(split_layout),
             element_levels_(max_elements),
             allow_replace_deleted_(allow_replace_deleted) {
+        if (memory)
+            memory_ = memory;
+        link_arena_.reset(new LinkListArena(memory_));
         max_elements_ = max_elements;
         num_deleted_ = 0;
         data_size_ = s->get_data_size();
@@ -141,13 +171,11 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         /// std::cout << "offsetData_ " << offsetData_ << ", label_offset_ = " << label_offset_ << std::endl;
         offsetLevel0_ = 0;
 
-        data_level0_memory_ = (char *) malloc(max_elements_ * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory");
+        allocLevel0(max_elements_);
 
         cur_element_count = 0;
 
-        visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, max_elements));
+        visited_list_pool_ = std::unique_ptr<VisitedListPool>(newVisitedListPool(max_elements));
 
         // initializations for special treatment of the first node
         enterpoint_node_ = -1;
@@ -169,12 +197,8 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     }
 
     void clear() {
-        free(data_level0_memory_);
-        data_level0_memory_ = nullptr;
-        for (tableint i = 0; i < cur_element_count; i++) {
-            if (element_levels_[i] > 0)
-                free(linkLists_[i]);
-        }
+        freeLevel0();
+        link_arena_->clear();
         free(linkLists_);
         linkLists_ = nullptr;
         cur_element_count = 0;
@@ -182,6 +206,84 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /* Level 0 layout. The hnswlib layout has one record per element in
+     * data_level0_memory_ : [level 0 links | vector | label]. The split layout
+     * keeps the links, the vectors and the labels in 3 arrays, so a graph
+     * traversal does not pull the vectors of rejected candidates into the
+     * cache. Files always have the record layout, getRecord()/setRecord()
+     * convert a record for the split layout. The arrays come from memory_,
+     * which places them on huge pages/NUMA nodes if the index asks for it.
+     */
+    char *allocLevel0Array(size_t size) {
+        return memory_->alloc(size);
+    }
+
+    char *resizeLevel0Array(char *array, size_t old_size, size_t new_size) {
+        char *array_new = allocLevel0Array(new_size);
+        memcpy(array_new, array, std::min(old_size, new_size));
+        memory_->free(array);
+        return array_new;
+    }
+
+    void setLevel0Pointers() {
+        if (!split_layout_) {
+            links_level0_memory_ = data_level0_memory_ + offsetLevel0_;
+            vector_memory_ = data_level0_memory_ + offsetData_;
+            label_memory_ = data_level0_memory_ + label_offset_;
+            links_stride_ = vector_stride_ = label_stride_ = size_data_per_element_;
+        } else {
+            links_stride_ = size_links_level0_;
+            vector_stride_ = data_size_;
+            label_stride_ = sizeof(labeltype);
+        }
+    }
+
+    void allocLevel0(size_t max_elements) {
+        if (!split_layout_) {
+            data_level0_memory_ = allocLevel0Array(max_elements * size_data_per_element_);
+        } else {
+            links_level0_memory_ = allocLevel0Array(max_elements * size_links_level0_);
+            vector_memory_ = allocLevel0Array(max_elements * data_size_);
+            label_memory_ = allocLevel0Array(max_elements * sizeof(labeltype));
+        }
+        setLevel0Pointers();
+    }
+
+    void freeLevel0() {
+        if (!split_layout_) {
+            memory_->free(data_level0_memory_);
+        } else {
+            memory_->free(links_level0_memory_);
+            memory_->free(vector_memory_);
+            memory_->free(label_memory_);
+        }
+        data_level0_memory_ = nullptr;
+        links_level0_memory_ = vector_memory_ = label_memory_ = nullptr;
+    }
+
+    void getRecord(tableint internal_id, char *record) const {
+        if (!split_layout_) {
+            memcpy(record, data_level0_memory_ + internal_id * size_data_per_element_,
+                   size_data_per_element_);
+            return;
+        }
+        memcpy(record + offsetLevel0_, get_linklist0(internal_id), size_links_level0_);
+        memcpy(record + offsetData_, getDataByInternalId(internal_id), data_size_);
+        memcpy(record + label_offset_, getExternalLabeLp(internal_id), sizeof(labeltype));
+    }
+
+    void setRecord(tableint internal_id, const char *record) {
+        if (!split_layout_) {
+            memcpy(data_level0_memory_ + internal_id * size_data_per_element_, record,
+                   size_data_per_element_);
+            return;
+        }
+        memcpy(get_linklist0(internal_id), record + offsetLevel0_, size_links_level0_);
+        memcpy(getDataByInternalId(internal_id), record + offsetData_, data_size_);
+        memcpy(getExternalLabeLp(internal_id), record + label_offset_, sizeof(labeltype));
+    }
+
+
     struct CompareByFirst {
         constexpr bool operator()(std::pair<dist_t, tableint> const& a,
             std::pair<dist_t, tableint> const& b) const noexcept {
@@ -195,6 +297,37 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /* newVisitedListPool - large indexes get sparse visited lists */
+    static VisitedListPool *newVisitedListPool(size_t max_elements) {
+        return new VisitedListPool(1, max_elements,
+                                   (max_elements >= VISITED_LIST_SPARSE_MIN_ELEMENTS));
+    }
+
+    /* getVisitedListMemory - bytes held by visited lists of all searches */
+    size_t getVisitedListMemory() const {
+        return (visited_list_pool_ ? visited_list_pool_->memoryUsage() : 0);
+    }
+
+    /* getLinkListMemory - bytes held by the upper level link lists */
+    size_t getLinkListMemory() const {
+        return (link_arena_ ? link_arena_->memoryUsage() : 0);
+    }
+
+    bool isVisitedListSparse() const {
+        return (visited_list_pool_ && visited_list_pool_->isSparse());
+    }
+
+
+    /* getLinkListMutex - lock of the link lists of an element. The locks are
+     * striped, so their memory does not grow with max_elements. A thread
+     * never holds more than one of them, so 2 elements sharing a stripe
+     * cannot deadlock.
+     */
+    inline std::mutex& getLinkListMutex(tableint internal_id) const {
+        return link_list_locks_[internal_id & (LINK_LIST_LOCK_STRIPES - 1)];
+    }
+
+
     inline std::mutex& getLabelOpMutex(labeltype label) const {
         // calculate hash
         size_t lock_id = label & (MAX_LABEL_OPERATION_LOCKS - 1);
@@ -204,23 +337,23 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
     inline labeltype getExternalLabel(tableint internal_id) const {
         labeltype return_label;
-        memcpy(&return_label, (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+        memcpy(&return_label, (label_memory_ + internal_id * label_stride_), sizeof(labeltype));
         return return_label;
     }
 
 
     inline void setExternalLabel(tableint internal_id, labeltype label) const {
-        memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+        memcpy((label_memory_ + internal_id * label_stride_), &label, sizeof(labeltype));
     }
 
 
     inline labeltype *getExternalLabeLp(tableint internal_id) const {
-        return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+        return (labeltype *) (label_memory_ + internal_id * label_stride_);
     }
 
 
     inline char *getDataByInternalId(tableint internal_id) const {
-        return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+        return (vector_memory_ + internal_id * vector_stride_);
     }
 
 
@@ -245,8 +378,6 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst>
     searchBaseLayer(tableint ep_id, const void *data_point, int layer) {
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
-        vl_type *visited_array = vl->mass;
-        vl_type visited_array_tag = vl->curV;
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidateSet;
@@ -261,7 +392,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             lowerBound = std::numeric_limits<dist_t>::max();
             candidateSet.emplace(-lowerBound, ep_id);
         }
-        visited_array[ep_id] = visited_array_tag;
+        vl->visit(ep_id);
 
         while (!candidateSet.empty()) {
             std::pair<dist_t, tableint> curr_el_pair = candidateSet.top();
@@ -272,7 +403,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
             tableint curNodeNum = curr_el_pair.second;
 
-            std::unique_lock <std::mutex> lock(link_list_locks_[curNodeNum]);
+            std::unique_lock <std::mutex> lock(getLinkListMutex(curNodeNum));
 
             int *data;  // = (int *)(linkList0_ + curNodeNum * size_links_per_element0_);
             if (layer == 0) {
@@ -284,8 +415,8 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             size_t size = getListCount((linklistsizeint*)data);
             tableint *datal = (tableint *) (data + 1);
 #ifdef USE_SSE
-            _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-            _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
+            _mm_prefetch((char *) vl->slotAddress(*(data + 1)), _MM_HINT_T0);
+            _mm_prefetch((char *) vl->slotAddress(*(data + 1) + 64), _MM_HINT_T0);
             _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
             _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
 #endif
@@ -294,11 +425,10 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                 tableint candidate_id = *(datal + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
+                _mm_prefetch((char *) vl->slotAddress(*(datal + j + 1)), _MM_HINT_T0);
                 _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
 #endif
-                if (visited_array[candidate_id] == visited_array_tag) continue;
-                visited_array[candidate_id] = visited_array_tag;
+                if (vl->visit(candidate_id)) continue;
                 char *currObj1 = (getDataByInternalId(candidate_id));
 
                 dist_t dist1 = fstdistfunc_(data_point, currObj1, dist_func_param_);
@@ -335,8 +465,6 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         BaseFilterFunctor* isIdAllowed = nullptr,
         BaseSearchStopCondition<dist_t>* stop_condition = nullptr) const {
         VisitedList *vl = visited_list_pool_->getFreeVisitedList();
-        vl_type *visited_array = vl->mass;
-        vl_type visited_array_tag = vl->curV;
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
@@ -357,7 +485,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             candidate_set.emplace(-lowerBound, ep_id);
         }
 
-        visited_array[ep_id] = visited_array_tag;
+        vl->visit(ep_id);
 
         while (!candidate_set.empty()) {
             std::pair<dist_t, tableint> current_node_pair = candidate_set.top();
@@ -388,9 +516,9 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             }
 
 #ifdef USE_SSE
-            _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-            _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
+            _mm_prefetch((char *) vl->slotAddress(*(data + 1)), _MM_HINT_T0);
+            _mm_prefetch((char *) vl->slotAddress(*(data + 1) + 64), _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*(data + 1)), _MM_HINT_T0);
             _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
 #endif
 
@@ -398,12 +526,11 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                 int candidate_id = *(data + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
-                _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
+                _mm_prefetch((char *) vl->slotAddress(*(data + j + 1)), _MM_HINT_T0);
+                _mm_prefetch(getDataByInternalId(*(data + j + 1)),
                                 _MM_HINT_T0);  ////////////
 #endif
-                if (!(visited_array[candidate_id] == visited_array_tag)) {
-                    visited_array[candidate_id] = visited_array_tag;
+                if (!vl->visit(candidate_id)) {
 
                     char *currObj1 = (getDataByInternalId(candidate_id));
                     dist_t dist = fstdistfunc_(data_point, currObj1, dist_func_param_);
@@ -418,8 +545,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                     if (flag_consider_candidate) {
                         candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                        _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
-                                        offsetLevel0_,  ///////////
+                        _mm_prefetch((char *) get_linklist0(candidate_set.top().second),
                                         _MM_HINT_T0);  ////////////////////////
 #endif
 
@@ -504,12 +630,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
 
     linklistsizeint *get_linklist0(tableint internal_id) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
-    }
-
-
-    linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (links_level0_memory_ + internal_id * links_stride_);
     }
 
 
@@ -528,8 +649,8 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         tableint cur_c,
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> &top_candidates,
         int level,
-        bool isUpdate) {
-        size_t Mcurmax = level ? maxM_ : maxM0_;
+        bool isUpdate,
+        std::vector<tableint> *deferredNeighbors = nullptr) {
         getNeighborsByHeuristic2(top_candidates, M_);
         if (top_candidates.size() > M_)
             throw std::runtime_error("Should be not be more than M_ candidates returned by the heuristic");
@@ -544,12 +665,9 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         tableint next_closest_entry_point = selectedNeighbors.back();
 
         {
-            // lock only during the update
-            // because during the addition the lock for cur_c is already acquired
-            std::unique_lock <std::mutex> lock(link_list_locks_[cur_c], std::defer_lock);
-            if (isUpdate) {
-                lock.lock();
-            }
+            // cur_c is not yet linked from the graph when it is a new element,
+            // the lock is for the update
+            std::unique_lock <std::mutex> lock(getLinkListMutex(cur_c));
             linklistsizeint *ll_cur;
             if (level == 0)
                 ll_cur = get_linklist0(cur_c);
@@ -574,10 +692,25 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         // MyVector HNSW Recovery - record this new/updated Node
         addNodeToFlushList(cur_c);
 
+        if (deferredNeighbors)
+            *deferredNeighbors = std::move(selectedNeighbors);
+        else
+            connectNeighbors(cur_c, selectedNeighbors, level, isUpdate);
+
+        return next_closest_entry_point;
+    }
+
+
+    /* connectNeighbors - add the reverse links of 'cur_c' to the link lists
+     * of its selected neighbors at 'level'.
+     */
+    void connectNeighbors(tableint cur_c, const std::vector<tableint> &selectedNeighbors,
+                          int level, bool isUpdate) {
+        size_t Mcurmax = level ? maxM_ : maxM0_;
         std::set<tableint> linksSet1,linksSet2;
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-            std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
+            std::unique_lock <std::mutex> lock(getLinkListMutex(selectedNeighbors[idx]));
 
             tableint neighbourId = selectedNeighbors[idx]; // MyVector
 
@@ -654,19 +787,19 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 #endif
                 }
                 // MyVector HNSW Recovery - record this link updated node
-                if (level == 0)
-                  //addNodeLinksLevel0ToFlushList(neighbourId);
-                  linksSet1.insert(neighbourId);
-                else
-                  linksSet2.insert(neighbourId);
-                  //addNodeLinksLevelGt0ToFlushList(neighbourId, level);
+                if (!m_bulkBuild) {
+                  if (level == 0)
+                    //addNodeLinksLevel0ToFlushList(neighbourId);
+                    linksSet1.insert(neighbourId);
+                  else
+                    linksSet2.insert(neighbourId);
+                    //addNodeLinksLevelGt0ToFlushList(neighbourId, level);
+                }
             } // if reverse links update from neighbours
         } // for all new node neighbours
 
         addNodeLinksLevel0ToFlushList(linksSet1);
         addNodeLinksLevelGt0ToFlushList(linksSet2,100);
-
-        return next_closest_entry_point;
     }
 
 
@@ -674,17 +807,24 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         if (new_max_elements < cur_element_count)
             throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
 
-        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
+        visited_list_pool_.reset(newVisitedListPool(new_max_elements));
 
         element_levels_.resize(new_max_elements);
 
-        std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
-
         // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
-        if (data_level0_memory_new == nullptr)
-            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-        data_level0_memory_ = data_level0_memory_new;
+        size_t n = cur_element_count;
+        if (!split_layout_) {
+            data_level0_memory_ = resizeLevel0Array(data_level0_memory_, n * size_data_per_element_,
+                                                    new_max_elements * size_data_per_element_);
+        } else {
+            links_level0_memory_ = resizeLevel0Array(links_level0_memory_, n * size_links_level0_,
+                                                     new_max_elements * size_links_level0_);
+            vector_memory_ = resizeLevel0Array(vector_memory_, n * data_size_,
+                                               new_max_elements * data_size_);
+            label_memory_ = resizeLevel0Array(label_memory_, n * sizeof(labeltype),
+                                              new_max_elements * sizeof(labeltype));
+        }
+        setLevel0Pointers();
 
         // Reallocate all other layers
         char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
@@ -750,6 +890,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId))+2;
             *ll_cur |= DELETE_MARK;
             num_deleted_ += 1;
+            addNodeLinksLevel0ToFlushList(internalId); /// mark is in the level 0 links
             if (allow_replace_deleted_) {
                 std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
                 deleted_elements.insert(internalId);
@@ -792,6 +933,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             unsigned char *ll_cur = ((unsigned char *)get_linklist0(internalId)) + 2;
             *ll_cur &= ~DELETE_MARK;
             num_deleted_ -= 1;
+            addNodeLinksLevel0ToFlushList(internalId);
             if (allow_replace_deleted_) {
                 std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
                 deleted_elements.erase(internalId);
@@ -927,7 +1069,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                 getNeighborsByHeuristic2(candidates, layer == 0 ? maxM0_ : maxM_);
 
                 {
-                    std::unique_lock <std::mutex> lock(link_list_locks_[neigh]);
+                    std::unique_lock <std::mutex> lock(getLinkListMutex(neigh));
                     linklistsizeint *ll_cur;
                     ll_cur = get_linklist_at_level(neigh, layer);
                     size_t candSize = candidates.size();
@@ -959,7 +1101,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                 while (changed) {
                     changed = false;
                     unsigned int *data;
-                    std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                    std::unique_lock <std::mutex> lock(getLinkListMutex(currObj));
                     data = get_linklist_at_level(currObj, level);
                     int size = getListCount(data);
                     tableint *datal = (tableint *) (data + 1);
@@ -1014,7 +1156,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
 
     std::vector<tableint> getConnectionsWithLock(tableint internalId, int level) {
-        std::unique_lock <std::mutex> lock(link_list_locks_[internalId]);
+        std::unique_lock <std::mutex> lock(getLinkListMutex(internalId));
         unsigned int *data = get_linklist_at_level(internalId, level);
         int size = getListCount(data);
         std::vector<tableint> result(size);
@@ -1057,30 +1199,32 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             label_lookup_[label] = cur_c;
         }
 
-        std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
         int curlevel = getRandomLevel(mult_);
         if (level > 0)
             curlevel = level;
 
         element_levels_[cur_c] = curlevel;
 
+        /* global is held only to read the entry point, unless this element
+         * is above maxlevel_ (or is the first element). Such an insert keeps
+         * it till it is the entry point, as in hnswlib, so that concurrent
+         * inserts above maxlevel_ do not both link only below the old top.
+         */
         std::unique_lock <std::mutex> templock(global);
         int maxlevelcopy = maxlevel_;
-        if (curlevel <= maxlevelcopy)
-            templock.unlock();
         tableint currObj = enterpoint_node_;
         tableint enterpoint_copy = enterpoint_node_;
+        if (curlevel <= maxlevelcopy)
+            templock.unlock();
 
-        memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+        memset(get_linklist0(cur_c), 0, size_links_level0_);
 
         // Initialisation of the data and label
         memcpy(getExternalLabeLp(cur_c), &label, sizeof(labeltype));
         memcpy(getDataByInternalId(cur_c), data_point, data_size_);
 
         if (curlevel) {
-            linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1);
-            if (linkLists_[cur_c] == nullptr)
-                throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
+            linkLists_[cur_c] = link_arena_->alloc(size_links_per_element_ * curlevel + 1);
             memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
         }
 
@@ -1092,7 +1236,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                     while (changed) {
                         changed = false;
                         unsigned int *data;
-                        std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
+                        std::unique_lock <std::mutex> lock(getLinkListMutex(currObj));
                         data = get_linklist(currObj, level);
                         int size = getListCount(data);
 
@@ -1112,6 +1256,11 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                 }
             }
 
+            /* All the link lists of cur_c are filled before it is linked from
+             * its neighbors, so that a concurrent insert or search that
+             * reaches cur_c does not stop at an empty lower level list.
+             */
+            std::vector<std::vector<tableint>> neighbors(std::min(curlevel, maxlevelcopy) + 1);
             bool epDeleted = isMarkedDeleted(enterpoint_copy);
             for (int level = std::min(curlevel, maxlevelcopy); level >= 0; level--) {
                 if (level > maxlevelcopy || level < 0)  // possible?
@@ -1124,8 +1273,11 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
                     if (top_candidates.size() > ef_construction_)
                         top_candidates.pop();
                 }
-                currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false);
+                currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false,
+                                                    &neighbors[level]);
             }
+            for (int level = neighbors.size() - 1; level >= 0; level--)
+                connectNeighbors(cur_c, neighbors[level], level, false);
         } else {
             // Do nothing for the first element
             enterpoint_node_ = 0;
@@ -1133,8 +1285,7 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
             addNodeToFlushList(cur_c); // MyVector - first element!
         }
 
-        // Releasing lock for the maximum level
-        if (curlevel > maxlevelcopy) {
+        if (curlevel > maxlevelcopy) { // global is held
             enterpoint_node_ = cur_c;
             maxlevel_ = curlevel;
         }
@@ -1144,13 +1295,27 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
 
     std::priority_queue<std::pair<dist_t, labeltype >>
     searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const {
+        return searchKnnEf(query_data, k, ef_, isIdAllowed);
+    }
+
+    /* searchKnnEf - searchKnn() with the ef of this query, ef_ is not read or
+     * changed so queries with different ef can run concurrently.
+     */
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnnEf(const void *query_data, size_t k, size_t ef,
+                BaseFilterFunctor* isIdAllowed = nullptr) const {
         std::priority_queue<std::pair<dist_t, labeltype >> result;
         if (cur_element_count == 0) return result;
 
+        /* Searches do not lock global, an insert may change the entry point
+         * and maxlevel_ between the 2 reads - only walk the levels that the
+         * entry point read here has.
+         */
         tableint currObj = enterpoint_node_;
-        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+        int maxlevel = std::min(maxlevel_, element_levels_[currObj]);
+        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(currObj), dist_func_param_);
 
-        for (int level = maxlevel_; level > 0; level--) {
+        for (int level = maxlevel; level > 0; level--) {
             bool changed = true;
             while (changed) {
                 changed = false;
@@ -1181,10 +1346,10 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         bool bare_bone_search = !num_deleted_ && !isIdAllowed;
         if (bare_bone_search) {
             top_candidates = searchBaseLayerST<true>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                    currObj, query_data, std::max(ef, k), isIdAllowed);
         } else {
             top_candidates = searchBaseLayerST<false>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                    currObj, query_data, std::max(ef, k), isIdAllowed);
         }
 
         while (top_candidates.size() > k) {
@@ -1208,9 +1373,10 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
         if (cur_element_count == 0) return result;
 
         tableint currObj = enterpoint_node_;
-        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
+        int maxlevel = std::min(maxlevel_, element_levels_[currObj]);
+        dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(currObj), dist_func_param_);
 
-        for (int level = maxlevel_; level > 0; level--) {
+        for (int level = maxlevel; level > 0; level--) {
             bool changed = true;
             while (changed) {
                 changed = false;
@@ -1253,6 +1419,101 @@ class HierarchicalDiskNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /* reorderNodes - renumber the internal ids in BFS order of the level 0
+     * graph, starting from the entry point. Neighbours get nearby ids, so a
+     * search reads vectors and link lists from fewer cache lines and pages.
+     * Nodes not reachable from the entry point keep their relative order at
+     * the end. No other thread may use the index during the reorder. The new
+     * layout is persisted by the next saveIndex().
+     */
+    void reorderNodes() {
+        size_t n = cur_element_count;
+        if (n <= 1 || n == reordered_element_count_)
+            return;
+
+        std::vector<tableint> new2old;
+        std::vector<tableint> old2new(n, (tableint)-1);
+        new2old.reserve(n);
+
+        old2new[enterpoint_node_] = 0;
+        new2old.push_back(enterpoint_node_);
+        for (size_t head = 0; head < new2old.size(); head++) {
+            linklistsizeint *ll = get_linklist0(new2old[head]);
+            size_t size = getListCount(ll);
+            tableint *datal = (tableint *) (ll + 1);
+            for (size_t j = 0; j < size; j++) {
+                if (old2new[datal[j]] == (tableint)-1) {
+                    old2new[datal[j]] = new2old.size();
+                    new2old.push_back(datal[j]);
+                }
+            }
+        }
+        for (tableint i = 0; i < n; i++) {
+            if (old2new[i] == (tableint)-1) {
+                old2new[i] = new2old.size();
+                new2old.push_back(i);
+            }
+        }
+
+        if (!split_layout_) {
+            permuteLevel0Array(data_level0_memory_, size_data_per_element_, new2old);
+        } else {
+            permuteLevel0Array(links_level0_memory_, size_links_level0_, new2old);
+            permuteLevel0Array(vector_memory_, data_size_, new2old);
+            permuteLevel0Array(label_memory_, sizeof(labeltype), new2old);
+        }
+        setLevel0Pointers();
+
+        std::vector<char *> linkLists_new(n);
+        std::vector<int> element_levels_new(n);
+        for (tableint i = 0; i < n; i++) {
+            linkLists_new[i] = linkLists_[new2old[i]];
+            element_levels_new[i] = element_levels_[new2old[i]];
+        }
+
+        for (tableint i = 0; i < n; i++) {
+            linkLists_[i] = linkLists_new[i];
+            element_levels_[i] = element_levels_new[i];
+            for (int l = 0; l <= element_levels_[i]; l++) {
+                linklistsizeint *ll = get_linklist_at_level(i, l);
+                size_t size = getListCount(ll);
+                tableint *datal = (tableint *) (ll + 1);
+                for (size_t j = 0; j < size; j++)
+                    datal[j] = old2new[datal[j]];
+            }
+        }
+
+        enterpoint_node_ = old2new[enterpoint_node_];
+
+        {
+            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
+            for (auto & l : label_lookup_)
+                l.second = old2new[l.second];
+        }
+        {
+            std::unique_lock <std::mutex> lock_deleted_elements(deleted_elements_lock);
+            std::unordered_set<tableint> deleted;
+            for (auto id : deleted_elements)
+                deleted.insert(old2new[id]);
+            deleted_elements.swap(deleted);
+        }
+
+        /* node ids in the flush lists and links file are stale */
+        clearFlushList();
+        m_linksOffsetsInFile.clear();
+        reordered_element_count_ = n;
+    }
+
+
+    void permuteLevel0Array(char *&array, size_t stride, const std::vector<tableint> &new2old) {
+        char *array_new = allocLevel0Array(max_elements_ * stride);
+        for (tableint i = 0; i < new2old.size(); i++)
+            memcpy(array_new + i * stride, array + new2old[i] * stride, stride);
+        memory_->free(array);
+        array = array_new;
+    }
+
+
     void checkIntegrity() {
         int connections_checked = 0;
         std::vector <int > inbound_connections_num(cur_element_count, 0);
@@ -84,21 +84,26 @@
      *
      * Node Links Level > 0 flush - A very low number of nodes will have level1,
      * level2, level3 ... links updated.
+     *
+     * A bulk build (m_bulkBuild) records nothing, it ends with a full write.
      */
     void addNodeToFlushList(tableint id) 
     {
+        if (m_bulkBuild) return;
         unsigned int index = rand() % FLUSH_LIST_PARTS;
         std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
         m_nodeUpdates[index].insert(id);
     }
     void addNodeLinksLevel0ToFlushList(tableint id) 
     {
+        if (m_bulkBuild) return;
         unsigned int index = rand() % FLUSH_LIST_PARTS;
         std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
         m_nodeLinksLevel0Updates[index].insert(id);
     }
     void addNodeLinksLevel0ToFlushList(std::set<tableint> & ids) 
     {
+        if (m_bulkBuild) return;
         unsigned int index = rand() % FLUSH_LIST_PARTS;
         std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
         for (auto id : ids)
@@ -106,12 +111,14 @@
     }
     void addNodeLinksLevelGt0ToFlushList(tableint id, int level)
     {
+        if (m_bulkBuild) return;
         unsigned int index = rand() % FLUSH_LIST_PARTS;
         std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
         m_nodeLinksLevelGt0Updates[index].insert(id);
     }
     void addNodeLinksLevelGt0ToFlushList(std::set<tableint> & ids, int level)
     {
+        if (m_bulkBuild) return;
         unsigned int index = rand() % FLUSH_LIST_PARTS;
         std::unique_lock <std::mutex> locklist(m_flushListMutex[index]);
         for (auto id : ids)
@@ -336,7 +343,30 @@
     const unsigned int FLUSH_OP_LEVEL_GT_0_LINKS  = 3;
     const unsigned int HNSW_FILE_METADATA_SIZE    = 96;
 
+    /* Set in the offsetLevel0_ word of the file header (always 0 in the
+     * record layout) if the index uses the split level 0 layout.
+     */
+    const size_t       HNSW_FILE_LAYOUT_SPLIT     = ((size_t)1 << 63);
+
+    /* Set in the offsetLevel0_ word of a checkpoint file header : full-node
+     * records are from the start of the record. Checkpoint files without it
+     * have the records from the vector (offsetData_).
+     */
+    const size_t       HNSW_CKPT_RECORD_START     = ((size_t)1 << 62);
+
+    /* Number of records read/written per call by saveIndex()/loadIndex()
+     * with the split layout.
+     */
+    const size_t       HNSW_FILE_RECORDS_PER_IO   = 4096;
+
+
+    /* setBulkBuild - new index that is written in full by saveIndex() when
+     * built, the inserts skip the checkpoint flush lists.
+     */
+    void setBulkBuild(bool bulk) { m_bulkBuild = bulk; }
+    bool isBulkBuild() const     { return m_bulkBuild; }
 
+    std::atomic<bool>                         m_bulkBuild{false};
     std::mutex                                m_flushListMutex[FLUSH_LIST_PARTS];
     std::set<tableint>                        m_nodeUpdates[FLUSH_LIST_PARTS];
     std::set<tableint>                        m_nodeLinksLevel0Updates[FLUSH_LIST_PARTS];
@@ -381,7 +411,7 @@
     }
 
 
-    saveIndexHeader(ckptFile, ckptFileName);
+    saveIndexHeader(ckptFile, ckptFileName, HNSW_CKPT_RECORD_START);
 
     /* Next is the scope or size of this checkpoint. */
     size_t s = mx_nodeUpdates.size();
@@ -396,13 +426,15 @@
 
     // Sort the flush lists in NodeID order - already done in ordered_set<>
 
+    std::vector<char> record(size_data_per_element_);
+
     for (auto nodeId : mx_nodeUpdates) {
         Write(ckptFile, &nodeId, sizeof(nodeId), ckptFileName, __LINE__);
         unsigned int sz = size_data_per_element_;
         Write(ckptFile, &sz, sizeof(sz), ckptFileName, __LINE__);
 
-        char *nodeVectorAndLevel0Links = getDataByInternalId(nodeId);
-        Write(ckptFile, nodeVectorAndLevel0Links, size_data_per_element_,
+        getRecord(nodeId, record.data());
+        Write(ckptFile, record.data(), size_data_per_element_,
               ckptFileName, __LINE__);
 
         unsigned int linkListSizeLevelGt0 =
@@ -457,13 +489,12 @@
     saveIndexHeader(hnswFile, hnswFileName);
 
     for (auto nodeId : mx_nodeUpdates) {
-        //char *nodeVectorAndLevel0Links = getDataByInternalId(nodeId);
-        char *nodeVectorAndLevel0Links = (char *)get_linklist0(nodeId);
+        getRecord(nodeId, record.data());
         
-        size_t ofs = (nodeVectorAndLevel0Links - data_level0_memory_) + HNSW_FILE_METADATA_SIZE;
+        size_t ofs = (nodeId * size_data_per_element_) + HNSW_FILE_METADATA_SIZE;
         Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
 
-        Write(hnswFile, nodeVectorAndLevel0Links, size_data_per_element_,
+        Write(hnswFile, record.data(), size_data_per_element_,
               hnswFileName, __LINE__);
 
         unsigned int linkListSizeLevelGt0 =
@@ -478,7 +509,8 @@
         if (mx_nodeUpdates.find(nodeId) != mx_nodeUpdates.end()) continue;
 
         char *level0Links = (char *)get_linklist0(nodeId);
-        size_t ofs = (level0Links - data_level0_memory_) + HNSW_FILE_METADATA_SIZE;
+        size_t ofs = (nodeId * size_data_per_element_) + offsetLevel0_ +
+                        HNSW_FILE_METADATA_SIZE;
         Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
         Write(hnswFile, level0Links, size_links_level0_, hnswFileName, __LINE__);
         /// debug_print("Write level0 links of %lu at %lu.", nodeId, ofs);
@@ -499,7 +531,8 @@
           element_levels_[nodeId] > 0 ? size_links_per_element_ * element_levels_[nodeId] : 0;
         if (linkListSize) {
             size_t datafileOfs = 0;
-            if (m_linksOffsetsInFile.find(nodeId) == m_linksOffsetsInFile.end()) {
+            bool   inFile = (m_linksOffsetsInFile.find(nodeId) != m_linksOffsetsInFile.end());
+            if (!inFile) {
               // first time addition of this node
               Lseek(linksDirOutput, 0, SEEK_END, linksLocation);
               Write(linksDirOutput, &nodeId, sizeof(nodeId),
@@ -511,7 +544,7 @@
             else {
               datafileOfs = m_linksOffsetsInFile[nodeId];
             }
-            if (datafileOfs)
+            if (inFile) // offset 0 is a valid offset - the first node in the file
                Lseek(linksDataOutput, datafileOfs, SEEK_SET, linksDataLocation);
             else
             {
@@ -551,7 +584,11 @@
       int hnswFile = Open(hnswFileName.c_str(), O_RDWR);
       
       //read all the metadata fields first - directly into members
-      readIndexHeader(ckptFile);
+      size_t ckptFlags = 0;
+      readIndexHeader(ckptFile, &ckptFlags);
+
+      /* Full-node records of an older checkpoint file go back at the vector */
+      size_t recordOfs = (ckptFlags & HNSW_CKPT_RECORD_START) ? 0 : offsetData_;
 
       saveIndexHeader(hnswFile, hnswFileName);
 
@@ -580,7 +617,7 @@
 
         read(ckptFile, rdbuf,   sz);
 
-        size_t ofs = (nodeId * size_data_per_element_) + offsetData_ +
+        size_t ofs = (nodeId * size_data_per_element_) + recordOfs +
                         HNSW_FILE_METADATA_SIZE;
 
         Lseek(hnswFile, ofs, SEEK_SET, hnswFileName);
@@ -654,7 +691,8 @@
         unsigned int linkListSize = iter.second.size();
         if (linkListSize) {
             size_t datafileOfs = 0;
-            if (gt0linksOffsetsInFile.find(nodeId) == gt0linksOffsetsInFile.end()) {
+            bool   inFile = (gt0linksOffsetsInFile.find(nodeId) != gt0linksOffsetsInFile.end());
+            if (!inFile) {
               // First time addition of this node - ordered map is key
               Lseek(linksDirOutput, 0, SEEK_END, linksLocation);
               Write(linksDirOutput, &nodeId, sizeof(nodeId),
@@ -665,7 +703,7 @@
             else {
               datafileOfs = gt0linksOffsetsInFile[nodeId];
             }
-            if (datafileOfs)
+            if (inFile) // offset 0 is a valid offset - the first node in the file
                Lseek(linksDataOutput, datafileOfs, SEEK_SET, linksDataLocation);
             else
             {
@@ -730,9 +768,12 @@
         return size;
     }
 
-    void saveIndexHeader(int hnswFile, const std::string & filename) {
+    void saveIndexHeader(int hnswFile, const std::string & filename,
+                         size_t flags = 0) {
 
-        Write(hnswFile, &offsetLevel0_, sizeof(offsetLevel0_), filename, __LINE__);
+        size_t offsetLevel0AndLayout = offsetLevel0_ | flags |
+                                       (split_layout_ ? HNSW_FILE_LAYOUT_SPLIT : 0);
+        Write(hnswFile, &offsetLevel0AndLayout, sizeof(offsetLevel0AndLayout), filename, __LINE__);
         Write(hnswFile, &max_elements_, sizeof(max_elements_), filename, __LINE__);
         Write(hnswFile, &cur_element_count, sizeof(cur_element_count), filename, __LINE__);
         Write(hnswFile, &size_data_per_element_, sizeof(size_data_per_element_), filename, __LINE__);
@@ -747,8 +788,12 @@
         Write(hnswFile, &ef_construction_, sizeof(ef_construction_), filename, __LINE__);
     }
     
-    void readIndexHeader(int hnswFile) {
+    void readIndexHeader(int hnswFile, size_t *flags = nullptr) {
         read(hnswFile, &offsetLevel0_, sizeof(offsetLevel0_));
+        split_layout_ = (offsetLevel0_ & HNSW_FILE_LAYOUT_SPLIT);
+        if (flags)
+          *flags = (offsetLevel0_ & HNSW_CKPT_RECORD_START);
+        offsetLevel0_ &= ~(HNSW_FILE_LAYOUT_SPLIT | HNSW_CKPT_RECORD_START);
         read(hnswFile, &max_elements_, sizeof(max_elements_));
         read(hnswFile, &cur_element_count, sizeof(cur_element_count));
         read(hnswFile, &size_data_per_element_, sizeof(size_data_per_element_));
@@ -799,15 +844,28 @@
         // This write() could do GBs of data write. All vectors & all level0
         // links are written to disk by this single Write() call.
         size_t xx = cur_element_count;
-        size_t wrc = 0, wc = (cur_element_count * size_data_per_element_);
-        while (1) {
-          ssize_t ret = write(hnswFile, &data_level0_memory_[wrc], wc);
-          if (ret < 0) {
-            break;
+        if (!split_layout_) {
+          size_t wrc = 0, wc = (cur_element_count * size_data_per_element_);
+          while (1) {
+            ssize_t ret = write(hnswFile, &data_level0_memory_[wrc], wc);
+            if (ret < 0) {
+              break;
+            }
+            wrc += ret;
+            wc -= ret;
+            if (!wc) break;
+          }
+        }
+        else {
+          // Split layout - gather the records, a batch per Write().
+          std::vector<char> records(HNSW_FILE_RECORDS_PER_IO * size_data_per_element_);
+          for (size_t i = 0; i < xx; i += HNSW_FILE_RECORDS_PER_IO) {
+            size_t nrec = std::min(HNSW_FILE_RECORDS_PER_IO, xx - i);
+            for (size_t j = 0; j < nrec; j++)
+              getRecord(i + j, &records[j * size_data_per_element_]);
+            Write(hnswFile, records.data(), nrec * size_data_per_element_,
+                  hnswFileName, __LINE__);
           }
-          wrc += ret;
-          wc -= ret;
-          if (!wc) break;
         }
 
         Fsync(hnswFile, hnswFileName);
@@ -818,6 +876,8 @@
         std::string linksDataLocation = hnswFileName + ".links.data";
         int gt0LinksDataF = Open(linksDataLocation.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
+        m_linksOffsetsInFile.clear();
+        size_t linksDataOfs = 0;
         for (size_t i = 0; i < cur_element_count; i++) {
             unsigned int linkListSize = element_levels_[i] > 0 ? 
               (size_links_per_element_ * element_levels_[i]) : 0;
@@ -829,6 +889,8 @@
               Write(gt0LinksF, &linkListSize, sizeof(linkListSize), linksLocation, __LINE__);
 
               Write(gt0LinksDataF, linkLists_[i], linkListSize, linksDataLocation, __LINE__);
+              m_linksOffsetsInFile[nodeID] = linksDataOfs;
+              linksDataOfs += linkListSize;
             }
         }
         Fsync(gt0LinksF, linksLocation);
@@ -859,6 +921,8 @@
         input.seekg(0, input.beg);
 
         readBinaryPOD(input, offsetLevel0_);
+        split_layout_ = (offsetLevel0_ & HNSW_FILE_LAYOUT_SPLIT);
+        offsetLevel0_ &= ~HNSW_FILE_LAYOUT_SPLIT;
         readBinaryPOD(input, max_elements_);
         readBinaryPOD(input, cur_element_count);
 #if 0
@@ -909,18 +973,28 @@
 #endif
         input.seekg(pos, input.beg);
 
-        data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
-
         size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
         size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
+
+        allocLevel0(max_elements);
+        if (!split_layout_) {
+            input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
+        }
+        else {
+            // Split layout - scatter the records, a batch per read().
+            std::vector<char> records(HNSW_FILE_RECORDS_PER_IO * size_data_per_element_);
+            for (size_t i = 0; i < cur_element_count; i += HNSW_FILE_RECORDS_PER_IO) {
+                size_t nrec = std::min(HNSW_FILE_RECORDS_PER_IO, cur_element_count - i);
+                input.read(records.data(), nrec * size_data_per_element_);
+                for (size_t j = 0; j < nrec; j++)
+                    setRecord(i + j, &records[j * size_data_per_element_]);
+            }
+        }
+        std::vector<std::mutex>(LINK_LIST_LOCK_STRIPES).swap(link_list_locks_);
         std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
 
-        visited_list_pool_.reset(new VisitedListPool(1, max_elements));
+        visited_list_pool_.reset(newVisitedListPool(max_elements));
 
         linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
         if (linkLists_ == nullptr)
@@ -952,14 +1026,18 @@
               break;
 
             element_levels_[nodeID] = linkListSize / size_links_per_element_;
-            linkLists_[nodeID] = (char *) malloc(linkListSize);
-            if (linkLists_[nodeID] == nullptr)
-               throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
-            inputLinksData.read(linkLists_[nodeID], linkListSize);
             m_linksOffsetsInFile[nodeID] = current_data_pos;
             current_data_pos = current_data_pos + linkListSize;
         } // while
 
+        // All link lists in one region, read with a single sequential read.
+        char *linksRegion = link_arena_->allocRegion(current_data_pos);
+        inputLinksData.read(linksRegion, current_data_pos);
+        if ((size_t)inputLinksData.gcount() != current_data_pos)
+            throw std::runtime_error("Index links file is truncated");
+        for (auto & ofs : m_linksOffsetsInFile)
+            linkLists_[ofs.first] = linksRegion + ofs.second;
+
         for (size_t i = 0; i < cur_element_count; i++) {
             if (isMarkedDeleted(i)) {
                 num_deleted_ += 1;
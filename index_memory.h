@@ -0,0 +1,369 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace hnswlib {
+
+/* mbind() policies, from <numaif.h> - libnuma is not needed for mbind() */
+#define INDEX_MEMORY_MPOL_BIND          2
+#define INDEX_MEMORY_MPOL_INTERLEAVE    3
+#define INDEX_MEMORY_MAX_NUMA_NODES     1024
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT                  26
+#endif
+
+static const size_t INDEX_MEMORY_PAGE_2M = (2UL << 20);
+static const size_t INDEX_MEMORY_PAGE_1G = (1UL << 30);
+
+/* IndexMemory - allocator for the big arrays of an index. Arrays can be
+ * backed by huge pages (hugetlbfs pages if the kernel has them reserved,
+ * else transparent huge pages via madvise) and placed on NUMA nodes with
+ * mbind(). Every step falls back to plain pages/default placement, and
+ * the placement actually obtained is counted for the index status.
+ */
+class IndexMemory {
+ public:
+    enum NumaPolicy { NUMA_DEFAULT, NUMA_INTERLEAVE, NUMA_NODE };
+
+    IndexMemory() {}
+
+    /* huge_page_size - 0, INDEX_MEMORY_PAGE_2M or INDEX_MEMORY_PAGE_1G */
+    IndexMemory(size_t huge_page_size, NumaPolicy numa, int numa_node)
+        : huge_page_size_(huge_page_size), numa_(numa), numa_node_(numa_node) {}
+
+    ~IndexMemory() {
+        for (auto & m : mappings_)
+            munmap(m.first, m.second.first);
+    }
+
+    bool isConfigured() const {
+        return (huge_page_size_ || numa_ != NUMA_DEFAULT);
+    }
+
+    NumaPolicy getNumaPolicy() const { return numa_; }
+    int        getNumaNode() const   { return numa_node_; }
+
+    /* alloc - 64-byte aligned array of 'size' bytes, release with free() */
+    char *alloc(size_t size) {
+        if (!size)
+            size = 64;
+        if (!isConfigured()) {
+            void *p = nullptr;
+            if (posix_memalign(&p, 64, size))
+                throw std::runtime_error("Not enough memory: failed to allocate index memory");
+            return (char *) p;
+        }
+
+        size_t mapsize = 0;
+        std::atomic<size_t> *counter = nullptr;
+        char *p = nullptr;
+        if (huge_page_size_ == INDEX_MEMORY_PAGE_1G)
+            p = mapHugeTLB(size, INDEX_MEMORY_PAGE_1G, 30, mapsize);
+        if (p) {
+            counter = &bytes_1g_;
+        } else if (huge_page_size_) {
+            p = mapHugeTLB(size, INDEX_MEMORY_PAGE_2M, 21, mapsize);
+            counter = &bytes_2m_;
+        }
+        if (!p) {
+            mapsize = roundUp(size, (huge_page_size_ ? INDEX_MEMORY_PAGE_2M : 4096));
+            void *m = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m == MAP_FAILED)
+                throw std::runtime_error("Not enough memory: failed to map index memory");
+            p = (char *) m;
+#ifdef MADV_HUGEPAGE
+            if (huge_page_size_ && madvise(p, mapsize, MADV_HUGEPAGE) == 0)
+                counter = &bytes_thp_;
+            else
+#endif
+                counter = &bytes_small_;
+        }
+        (*counter) += mapsize;
+
+        if (numa_ != NUMA_DEFAULT)
+            bindNuma(p, mapsize);
+
+        std::lock_guard<std::mutex> l(mutex_);
+        mappings_[p] = std::make_pair(mapsize, counter);
+        return p;
+    }
+
+    void free(char *p) {
+        if (!p)
+            return;
+        if (!isConfigured()) {
+            ::free(p);
+            return;
+        }
+        size_t mapsize = 0;
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            auto it = mappings_.find(p);
+            if (it == mappings_.end())
+                return;
+            mapsize = it->second.first;
+            (*it->second.second) -= mapsize;
+            mappings_.erase(it);
+        }
+        munmap(p, mapsize);
+    }
+
+    /* describePages - bytes held per page type, e.g "2MB hugetlb : 1073741824" */
+    std::string describePages() const {
+        std::stringstream ss;
+        if (!isConfigured())
+            return "default (malloc)";
+        if (bytes_1g_)    ss << "1GB hugetlb : " << bytes_1g_ << " ";
+        if (bytes_2m_)    ss << "2MB hugetlb : " << bytes_2m_ << " ";
+        if (bytes_thp_)   ss << "THP advised : " << bytes_thp_ << " ";
+        if (bytes_small_) ss << "4KB : " << bytes_small_ << " ";
+        return ss.str();
+    }
+
+    /* describeNuma - the placement requested and whether mbind() worked */
+    std::string describeNuma() const {
+        std::stringstream ss;
+        if (numa_ == NUMA_DEFAULT)
+            return "default";
+        ss << (numa_ == NUMA_INTERLEAVE ? "interleave" : "node:" + std::to_string(numa_node_));
+        if (numa_errno_)
+            ss << " (mbind failed, errno=" << numa_errno_ << ", using default)";
+        return ss.str();
+    }
+
+    /* parseNumaOption - numa=interleave or numa=node:N, false if malformed */
+    static bool parseNumaOption(const std::string & val, NumaPolicy & numa, int & node) {
+        numa = NUMA_DEFAULT;
+        node = -1;
+        if (val == "" || val == "default")
+            return true;
+        if (val == "interleave") {
+            numa = NUMA_INTERLEAVE;
+            return true;
+        }
+        if (val.compare(0, 5, "node:") == 0 && val.length() > 5 &&
+            val.find_first_not_of("0123456789", 5) == std::string::npos) {
+            numa = NUMA_NODE;
+            node = atoi(val.c_str() + 5);
+            return (node < INDEX_MEMORY_MAX_NUMA_NODES);
+        }
+        return false;
+    }
+
+ private:
+    size_t      huge_page_size_{0};
+    NumaPolicy  numa_{NUMA_DEFAULT};
+    int         numa_node_{-1};
+    std::atomic<int> numa_errno_{0};
+
+    std::mutex  mutex_;
+    std::unordered_map<char *, std::pair<size_t, std::atomic<size_t> *>> mappings_;
+
+    std::atomic<size_t> bytes_1g_{0};
+    std::atomic<size_t> bytes_2m_{0};
+    std::atomic<size_t> bytes_thp_{0};
+    std::atomic<size_t> bytes_small_{0};
+
+    static size_t roundUp(size_t size, size_t page) {
+        return ((size + page - 1) / page) * page;
+    }
+
+    char *mapHugeTLB(size_t size, size_t page, int pageshift,
+                     size_t & mapsize) {
+#ifdef MAP_HUGETLB
+        mapsize = roundUp(size, page);
+        void *m = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                       (pageshift << MAP_HUGE_SHIFT), -1, 0);
+        if (m != MAP_FAILED)
+            return (char *) m;
+#endif
+        return nullptr;
+    }
+
+    void bindNuma(char *p, size_t size) {
+        unsigned long nodemask[INDEX_MEMORY_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+        memset(nodemask, 0, sizeof(nodemask));
+        int mode = INDEX_MEMORY_MPOL_BIND;
+        if (numa_ == NUMA_INTERLEAVE) {
+            mode = INDEX_MEMORY_MPOL_INTERLEAVE;
+            int nnodes = numNodes();
+            for (int i = 0; i < nnodes; i++)
+                nodemask[i / (8 * sizeof(unsigned long))] |= (1UL << (i % (8 * sizeof(unsigned long))));
+        } else {
+            nodemask[numa_node_ / (8 * sizeof(unsigned long))] |=
+                (1UL << (numa_node_ % (8 * sizeof(unsigned long))));
+        }
+#ifdef SYS_mbind
+        if (syscall(SYS_mbind, p, size, mode, nodemask,
+                    (unsigned long) INDEX_MEMORY_MAX_NUMA_NODES, 0) != 0)
+            numa_errno_ = errno;
+#else
+        numa_errno_ = ENOSYS;
+#endif
+    }
+
+    static int numNodes() {
+        int n = 0;
+        while (n < INDEX_MEMORY_MAX_NUMA_NODES &&
+               access(("/sys/devices/system/node/node" + std::to_string(n)).c_str(), F_OK) == 0)
+            n++;
+        return (n ? n : 1);
+    }
+};
+
+/* Number of per-thread allocation slots of a LinkListArena (power of 2) */
+static const size_t LINK_ARENA_THREAD_SLOTS = 64;
+
+/* Size of LinkListArena chunks - the first chunk of a thread is small, so
+ * that small indexes (e.g partitions) stay small, and the size doubles up
+ * to a 2MB huge page.
+ */
+static const size_t LINK_ARENA_MIN_CHUNK_SIZE = (64UL << 10);
+static const size_t LINK_ARENA_CHUNK_SIZE     = (2UL << 20);
+
+/* LinkListArena - bump pointer allocator for the upper level link lists of
+ * an HNSW index. Link lists live as long as the index, so nothing is freed
+ * one by one - clear() releases all chunks. Each thread allocates from its
+ * own slot, so a parallel build does not contend on one allocator lock.
+ * Chunks come from IndexMemory, with its huge page/NUMA placement.
+ */
+class LinkListArena {
+ public:
+    LinkListArena(std::shared_ptr<IndexMemory> memory) : memory_(memory) {}
+
+    ~LinkListArena() { clear(); }
+
+    /* alloc - 8-byte aligned, uninitialized block of 'size' bytes */
+    char *alloc(size_t size) {
+        size = (size + 7) & ~((size_t)7);
+        if (size > LINK_ARENA_MIN_CHUNK_SIZE / 8)
+            return allocRegion(size);
+
+        Slot & slot = slots_[threadSlot()];
+        std::lock_guard<std::mutex> l(slot.mutex);
+        if (slot.left < size) {
+            slot.chunk = std::min(std::max(slot.chunk * 2, LINK_ARENA_MIN_CHUNK_SIZE),
+                                  LINK_ARENA_CHUNK_SIZE);
+            slot.cur = allocRegion(slot.chunk);
+            slot.left = slot.chunk;
+        }
+        char *p = slot.cur;
+        slot.cur += size;
+        slot.left -= size;
+        return p;
+    }
+
+    /* allocRegion - a chunk of its own, e.g all link lists read by loadIndex() */
+    char *allocRegion(size_t size) {
+        char *p = memory_->alloc(size);
+        std::lock_guard<std::mutex> l(chunks_mutex_);
+        chunks_.push_back(p);
+        bytes_ += size;
+        return p;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> l(chunks_mutex_);
+        for (auto p : chunks_)
+            memory_->free(p);
+        chunks_.clear();
+        bytes_ = 0;
+        for (size_t i = 0; i < LINK_ARENA_THREAD_SLOTS; i++) {
+            slots_[i].cur = nullptr;
+            slots_[i].left = 0;
+            slots_[i].chunk = 0;
+        }
+    }
+
+    /* memoryUsage - bytes of all chunks */
+    size_t memoryUsage() const { return bytes_; }
+
+ private:
+    struct Slot {
+        std::mutex mutex;
+        char      *cur{nullptr};
+        size_t     left{0};
+        size_t     chunk{0}; /// size of the last chunk
+    };
+
+    std::shared_ptr<IndexMemory> memory_;
+    Slot                         slots_[LINK_ARENA_THREAD_SLOTS];
+    std::mutex                   chunks_mutex_;
+    std::vector<char *>          chunks_;
+    std::atomic<size_t>          bytes_{0};
+
+    static size_t threadSlot() {
+        static std::atomic<size_t> next_slot{0};
+        thread_local size_t slot = next_slot++;
+        return slot & (LINK_ARENA_THREAD_SLOTS - 1);
+    }
+};
+
+/* NodeAffinityGuard - run the current thread on the CPUs of a NUMA node
+ * (from nodeCpus()) for the lifetime of the guard, the previous affinity
+ * is restored after. Costs 3 system calls, a null 'cpus' is a no-op.
+ */
+class NodeAffinityGuard {
+ public:
+    NodeAffinityGuard(const cpu_set_t *cpus) {
+        if (!cpus)
+            return;
+        if (sched_getaffinity(0, sizeof(saved_), &saved_) != 0)
+            return;
+        pinned_ = (sched_setaffinity(0, sizeof(*cpus), cpus) == 0);
+    }
+
+    ~NodeAffinityGuard() {
+        if (pinned_)
+            sched_setaffinity(0, sizeof(saved_), &saved_);
+    }
+
+    /* nodeCpus - CPUs of a node from sysfs cpulist e.g "0-15,32-47" */
+    static bool nodeCpus(int node, cpu_set_t & set) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!f.is_open() || !std::getline(f, list))
+            return false;
+        CPU_ZERO(&set);
+        std::stringstream ss(list);
+        std::string range;
+        int ncpus = 0;
+        while (std::getline(ss, range, ',')) {
+            int lo = 0, hi = 0;
+            int n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+            if (n < 1)
+                continue;
+            if (n == 1)
+                hi = lo;
+            for (int c = lo; c <= hi && c < CPU_SETSIZE; c++, ncpus++)
+                CPU_SET(c, &set);
+        }
+        return (ncpus > 0);
+    }
+
+ private:
+    cpu_set_t saved_;
+    bool      pinned_{false};
+};
+
+}  // namespace hnswlib
@@ -29,10 +29,16 @@
 #include <thread>
 #include <vector>
 #include <list>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <set>
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
+#include <charconv>
+#include <cmath>
 
 #ifdef WIN32
 #define PLUGIN_EXPORT extern "C" __declspec(dllexport)
@@ -133,10 +139,14 @@ class AbstractVectorIndex;
  * Byte 2 - Native datatype of vector elements. e.g FP32, FP16 etc
  * Byte 3 - Unused
  * Byte 4 - Unused
+ * The 4 byte checksum after the metadata is my_checksum() in V1 and CRC32C
+ * in V2. New vectors are V2, V1 vectors are still read.
  */
 
 static const unsigned int MYVECTOR_VERSION_V1  = 0x01;
 
+static const unsigned int MYVECTOR_VERSION_V2  = 0x02;
+
 static const unsigned int MYVECTOR_VECTOR_FP32 = 0x01;
 
 static const unsigned int MYVECTOR_VECTOR_FP16 = 0x02;
@@ -149,6 +159,12 @@ static const unsigned int MYVECTOR_VECTOR_BV   = 0x04;
 #define MYVECTOR_V1_BV_METADATA \
     ((MYVECTOR_VECTOR_BV  << 8) | MYVECTOR_VERSION_V1)
 
+#define MYVECTOR_V2_FP32_METADATA \
+   ((MYVECTOR_VECTOR_FP32 << 8) | MYVECTOR_VERSION_V2)
+
+#define MYVECTOR_V2_BV_METADATA \
+    ((MYVECTOR_VECTOR_BV  << 8) | MYVECTOR_VERSION_V2)
+
 /* Maximum length of string that can be passed to myvector_construct(). */
   
 static const unsigned int MYVECTOR_CONSTRUCT_MAX_LEN = 128000;
@@ -158,7 +174,9 @@ static const unsigned int MYVECTOR_CONSTRUCT_MAX_LEN = 128000;
  */
 static const unsigned int MYVECTOR_DISPLAY_MAX_LEN   = 128000;
 
-/* Default precision for float output in myvector_display() */
+/* Default precision for float output in myvector_display(). Option
+   prec=shortest is the shortest string that reads back as the same float.
+ */
 static const unsigned int MYVECTOR_DISPLAY_DEF_PREC  = 7;
 
 /* Overhead per MYVECTOR column value - 4 bytes for checksum and
@@ -176,19 +194,40 @@ static const unsigned int MYVECTOR_DEFAULT_ANN_RETURN_COUNT = 10;
 /* Max number of neighbours that can be retrieved in single myvector_ann_set() */
 static const unsigned int MYVECTOR_MAX_ANN_RETURN_COUNT = 10000;
 
+/* Buffer space for return value of myvector_ann_set() - upto 20 digits and
+   a separator for each id, plus the enclosing [].
+ */
+static const unsigned int MYVECTOR_ANN_SET_MAX_LEN =
+                            (MYVECTOR_MAX_ANN_RETURN_COUNT * 21) + 2;
+
 /* Basic check for validity of index last update timestamp > '01-01-2024' */
 static const unsigned long MYVECTOR_MIN_VALID_UPDATE_TS = 1704047400;
 
-/* Parallel threads are started after 100K vectors + keys have been batch'ed up */
-static const unsigned int HNSW_PARALLEL_BUILD_UNIT_SIZE = 100000;
+/* Parallel build - vectors + keys are handed to the worker pool in units of
+ * 1K rows, at most 4 units per build thread are queued in the pool.
+ */
+static const unsigned int HNSW_PARALLEL_BUILD_UNIT_SIZE        = 1024;
+static const unsigned int HNSW_PARALLEL_BUILD_UNITS_PER_THREAD = 4;
+
+/* Adaptive early termination (search option target_recall=<r>) is calibrated
+ * in the background, with queries made from a sample of the stored vectors
+ * (perturbed by noise of ~HNSW_CALIBRATION_NOISE x the vector norm) against
+ * brute force neighbours.
+ */
+static const unsigned int HNSW_CALIBRATION_QUERIES      = 200;
+static const unsigned int HNSW_CALIBRATION_K            = 10;
+static const double       HNSW_CALIBRATION_NOISE        = 0.1;
+static const size_t       HNSW_ADAPTIVE_PATIENCE[]      = {2, 4, 8, 16, 32, 64, 128, 256, 512};
 
 /* Bit packing for Binary Vectors */
 static const unsigned int BITS_PER_BYTE                 = 8;
 
 extern char *myvector_index_dir;
 extern long myvector_feature_level;
+extern bool myvector_verify_checksum;
 
 char *latin1 = const_cast<char *>("latin1");
+char *binary = const_cast<char *>("binary");
 
 const set<string> MYVECTOR_INDEX_TYPES{"KNN", "HNSW", "HNSW_BV"};
 
@@ -220,18 +259,134 @@ inline int MyVectorBVDimFromStorageLength(int length)
     return (length - MYVECTOR_COLUMN_EXTRA_LEN) * BITS_PER_BYTE;
 }
 
-/* Compute L2/Eucliean squared distance via optimized function from hnswlib */
+/* CRC32C (Castagnoli) - with the SSE4.2 or ARMv8 CRC instructions if the
+ * CPU has them, else table driven.
+ */
+static uint32_t CRC32CSoftware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    static const uint32_t *table = [] {
+        static uint32_t t[256];
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : (c >> 1);
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    while (len--)
+        crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(USE_SSE) && defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t CRC32CHardware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    for (; len; len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+    return crc;
+}
+
+static bool CRC32CHardwareCapable()
+{
+    int cpuInfo[4];
+    cpuid(cpuInfo, 1, 0);
+    return (cpuInfo[2] & (1 << 20)) != 0; /// SSE4.2
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t CRC32CHardware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t v;
+        memcpy(&v, buf, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for (; len; len--)
+        crc = __crc32cb(crc, *buf++);
+    return crc;
+}
+
+static bool CRC32CHardwareCapable() { return true; }
+#else
+static uint32_t CRC32CHardware(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    return CRC32CSoftware(crc, buf, len);
+}
+
+static bool CRC32CHardwareCapable() { return false; }
+#endif
+
+static uint32_t MyVectorCRC32C(const unsigned char *buf, size_t len)
+{
+    static const bool hw = CRC32CHardwareCapable();
+    uint32_t crc = 0xffffffff;
+    crc = (hw ? CRC32CHardware(crc, buf, len) : CRC32CSoftware(crc, buf, len));
+    return ~crc;
+}
+
+#if MYSQL_VERSION_ID < 90000
+/* MyVectorChecksum - checksum of a serialized vector of length 'len' that
+ * ends with 4 bytes of metadata, for the format version in the metadata.
+ */
+static ha_checksum MyVectorChecksum(const unsigned char *buf, size_t len)
+{
+    unsigned int metadata = 0;
+    memcpy(&metadata, &buf[len - sizeof(metadata)], sizeof(metadata));
+    if ((metadata & 0xff) == MYVECTOR_VERSION_V2)
+        return MyVectorCRC32C(buf, len);
+    return my_checksum(0, buf, len);
+}
+
+/* MyVectorVerifyChecksum - true if the checksum at the end of the stored
+ * vector 'raw' of length 'len' is good.
+ */
+static bool MyVectorVerifyChecksum(const char *raw, size_t len)
+{
+    if (len < MYVECTOR_COLUMN_EXTRA_LEN)
+        return false;
+
+    ha_checksum cksum1;
+    memcpy((char *)&cksum1, &raw[len - sizeof(ha_checksum)], sizeof(ha_checksum));
+    ha_checksum cksum2 = MyVectorChecksum((const unsigned char *)raw,
+                                          len - sizeof(ha_checksum));
+    if (cksum1 != cksum2) {
+        debug_print("vector checksum failure (%u != %u)", cksum1, cksum2);
+        return false;
+    }
+    return true;
+}
+#endif
+
+/* Compute L2/Eucliean squared distance via optimized function from hnswlib.
+ * The hnswlib function for a dimension is picked once per thread, setting
+ * up the space runs cpuid.
+ */
 double computeL2Distance(const FP32 * __restrict v1, const FP32 * __restrict v2, int dim)
 {
-    hnswlib::L2Space         sp(dim);
-    hnswlib::DISTFUNC<FP32>  distfn;
-    double                   dist = 0.0;
-    size_t                   sdim = dim;
+    static thread_local size_t                  kdim   = 0;
+    static thread_local hnswlib::DISTFUNC<FP32> distfn = nullptr;
+    double                                      dist   = 0.0;
+    size_t                                      sdim   = dim;
 
     if (v1 && v2 && dim)
     {
-        distfn = sp.get_dist_func();
-        dist   = distfn(v1, v2, &sdim);
+        if (kdim != sdim) {
+            hnswlib::L2Space sp(sdim);
+            distfn = sp.get_dist_func();
+            kdim   = sdim;
+        }
+        dist = distfn(v1, v2, &sdim);
     }
 
     return dist;
@@ -240,15 +395,19 @@ double computeL2Distance(const FP32 * __restrict v1, const FP32 * __restrict v2,
 /* Compute InnerProduct distance via optimized function from hnswlib */
 double computeIPDistance(const FP32 * __restrict v1, const FP32 * __restrict v2, int dim)
 {
-    hnswlib::InnerProductSpace sp(dim);
-    hnswlib::DISTFUNC<FP32>    distfn;
-    double                     dist = 0.0;
-    size_t                     sdim = dim;
+    static thread_local size_t                  kdim   = 0;
+    static thread_local hnswlib::DISTFUNC<FP32> distfn = nullptr;
+    double                                      dist   = 0.0;
+    size_t                                      sdim   = dim;
 
     if (v1 && v2 && dim)
     {
-        distfn = sp.get_dist_func();
-        dist   = distfn(v1,v2,&sdim);
+        if (kdim != sdim) {
+            hnswlib::InnerProductSpace sp(sdim);
+            distfn = sp.get_dist_func();
+            kdim   = sdim;
+        }
+        dist = distfn(v1, v2, &sdim);
     }
 
     return dist;
@@ -411,7 +570,11 @@ public:
     string getStatus();
 
     bool searchVectorNN(VectorPtr qvec, int dim,
-                        vector<KeyTypeInteger> & keys, int n);
+                        vector<KeyTypeInteger> & keys, int n,
+                        const VectorSearchParams & params = VectorSearchParams());
+    bool searchVectorRange(VectorPtr qvec, int dim,
+                           vector<KeyTypeInteger> & keys, double radius, int maxn,
+                           const VectorSearchParams & params = VectorSearchParams());
     bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
 
     bool        supportsIncrUpdates() { return true; }
@@ -477,7 +640,8 @@ KNNIndex::KNNIndex(const string & name, const string & options)
 /* Brute-force, exact search KNN implemented using in-memory vector<> and
  * priority queue. Potentially faster than SELECT ... ORDER BY myvector_distance()
  */
-bool KNNIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n)
+bool KNNIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n,
+                              const VectorSearchParams &)
 {
     std::shared_lock lock(search_insert_mutex_);
 
@@ -517,6 +681,44 @@ bool KNNIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> &
     return true;
 }
 
+/* Brute-force range search - every row within 'radius', nearest 'maxn' kept */
+bool KNNIndex::searchVectorRange(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys,
+                                 double radius, int maxn, const VectorSearchParams &)
+{
+    std::shared_lock lock(search_insert_mutex_);
+
+    priority_queue< pair<FP32, KeyTypeInteger> > pq;
+    keys.clear();
+    tls_distances->clear();
+
+    if (maxn <= 0)
+        return true;
+    size_t limit = (size_t)maxn;
+
+    for (auto & row : m_vectors)
+    {
+        FP32 dist = (FP32)m_distfn((FP32 *)qvec, row.first.data(), m_dim);
+
+        if (dist > radius)
+            continue;
+        pq.push({dist, row.second});
+        if (pq.size() > limit)
+            pq.pop(); /// drop the farthest
+    } /* for */
+
+    while (pq.size())
+    {
+        auto r = pq.top(); pq.pop();
+        keys.push_back(r.second);
+        (*tls_distances)[r.second] = r.first; /// pkid -> distance
+    }
+
+    reverse(keys.begin(), keys.end()); /// nearest to farthest
+
+    m_n_searches++;
+    return true;
+}
+
 /* insertVector - just stash the vector into in-memory vector<> collection */
 bool KNNIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id)
 {
@@ -594,6 +796,48 @@ string KNNIndex::getStatus()
     return ss.str();
 }
 
+/* SearchGate - keeps searches out of a HNSW graph while its nodes are
+ * renumbered by reorderNodes(). The index being built can already be open
+ * e.g on its first build. Searches only count themselves in, they do not
+ * share a lock.
+ */
+class SearchGate
+{
+public:
+    void enter() {
+        while (true) {
+            m_active++;
+            if (!m_closed)
+                return;
+            m_active--;
+            while (m_closed)
+                this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    void leave() { m_active--; }
+
+    /* close - wait for the running searches, new ones wait till open() */
+    void close() {
+        m_closed = true;
+        while (m_active)
+            this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    void open()  { m_closed = false; }
+
+private:
+    atomic<unsigned int> m_active{0};
+    atomic<bool>         m_closed{false};
+};
+
+class SearchGateGuard
+{
+public:
+    SearchGateGuard(SearchGate & gate) : m_gate(gate) { m_gate.enter(); }
+    ~SearchGateGuard() { m_gate.leave(); }
+private:
+    SearchGate & m_gate;
+};
+
 class HNSWMemoryIndex : public AbstractVectorIndex
 {
 public:
@@ -603,6 +847,7 @@ public:
           
     bool        supportsIncrUpdates() { return m_incrUpdates; }
     bool        supportsIncrRefresh() { return m_incrRefresh; }
+    bool        supportsConcurrentUpdates() { return true; } /// unless startParallelBuild()
     bool        isDirty()             { return m_isDirty; }
 
     bool saveIndex(const string & path, const string & option);
@@ -623,10 +868,27 @@ public:
     
     string getStatus();
 
-    bool searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n);
+    bool searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n,
+                        const VectorSearchParams & params = VectorSearchParams());
+
+    bool searchVectorRange(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys,
+                           double radius, int maxn,
+                           const VectorSearchParams & params = VectorSearchParams());
+
+    bool searchVectorDocs(VectorPtr qvec, int dim, vector<KeyTypeInteger> & docids,
+                          int ndocs,
+                          const VectorSearchParams & params = VectorSearchParams());
           
     bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
 
+    bool insertVectorDoc(VectorPtr vec, int dim, KeyTypeInteger id, KeyTypeInteger docid);
+
+    bool deleteVector(KeyTypeInteger id);
+
+    void getKeys(vector<KeyTypeInteger> & keys);
+
+    string getDocIdColumn() { return m_docidCol; }
+
 
     int getDimension()                  { return m_dim; }
 
@@ -635,6 +897,16 @@ public:
     unsigned long getUpdateTs()         { return m_updateTs; }
           
     unsigned long getRowCount()         { return m_n_rows; }
+
+    void setBuildStats(unsigned long rows, double secs)
+        { m_buildRows = rows; m_buildSecs = secs; }
+
+    bool supportsResumableBuild()       { return true; }
+    bool saveBuildState(const string & path, KeyTypeInteger lastKey,
+                        const string & binlogFile, size_t binlogPos);
+    bool loadBuildState(const string & path, KeyTypeInteger & lastKey,
+                        string & binlogFile, size_t & binlogPos);
+    void dropBuildState(const string & path);
           
     bool startParallelBuild(int nthreads);
     
@@ -651,6 +923,17 @@ public:
     void setSearchEffort(int ef_search);
 
 private:
+    size_t getPatience(double target_recall, size_t ef);
+    size_t calibrate(double target_recall, size_t ef);
+    void   calibratePending();
+    void   stopCalibration();
+    void   loadCalibration(const string & path);
+    void   saveCalibration(const string & path);
+    string calibrationFileName(const string & path)
+        { return path + "/" + m_name + ".hnsw.index.calib"; }
+    string buildFileName(const string & path)
+        { return path + "/" + m_name + ".hnsw.index.build"; }
+
     string        m_name;
     string        m_type;
     string        m_options;
@@ -659,18 +942,32 @@ private:
 
     int         m_dim;
     int         m_ef_construction;
-    int         m_ef_search;
+    int         m_ef_search; /// default, queries can override
     int         m_M;
     int         m_size;
 
     string      m_dist;
+    string      m_docidCol; /// multi-vector index, doc id is stored after the vector
+    bool        m_reorderBFS; /// reorder=bfs : renumber nodes for locality after build
+    bool        m_layoutSplit; /// layout=split : links, vectors and labels in separate arrays
+
+    /// hugepages=Y|1G, numa=interleave|node:N : placement of the level 0 arrays
+    shared_ptr<hnswlib::IndexMemory> m_memory;
+    cpu_set_t   m_numaCpus;
+    bool        m_numaPin{false}; /// numa_pin=Y : searches run on the CPUs of numa=node:N
           
     hnswlib::AlgorithmInterface<FP32> *m_alg_hnsw = nullptr;
     hnswlib::SpaceInterface<float>* m_space = nullptr;
+    hnswlib::BaseMultiVectorSpace<KeyTypeInteger>* m_mvspace = nullptr; /// m_space if docid=
 
     atomic<unsigned long>    m_n_rows{0};
     atomic<unsigned long>    m_n_searches{0};
 
+    SearchGate               m_searchGate; /// closed during reorderNodes()
+
+    unsigned long            m_buildRows{0}; /// last build
+    double                   m_buildSecs{0};
+
     bool                     m_isDirty;
 
     bool                     m_incrUpdates;
@@ -679,10 +976,13 @@ private:
     /* Temporary store for multi-threaded, parallel index build */
     vector<char>           m_batch;
     vector<KeyTypeInteger> m_batchkeys;
+    deque<future<void>>    m_batchesInFlight;
     bool                   m_isParallelBuild{false};
 
-    bool                   flushBatchParallel();
-    bool                   flushBatchSerial();
+    void                   flushBatch();
+    void                   waitBatches(size_t maxInFlight);
+
+    bool                   insertData(void *data, KeyTypeInteger id);
 
     int                    m_threads;
 
@@ -690,6 +990,14 @@ private:
     string                 m_binlogFile;
     size_t                 m_binlogPosition;
 
+    /// (target recall per mille, ef) -> patience of AdaptiveSearchStopCondition
+    std::mutex                         m_calibMutex;
+    map<pair<int, size_t>, size_t>     m_calibration;
+    set<pair<int, size_t>>             m_calibPending; /// to be calibrated
+    bool                               m_calibRunning{false};
+    atomic<bool>                       m_calibStop{false};
+    future<void>                       m_calibTask;
+
 };
 
 
@@ -704,6 +1012,33 @@ HNSWMemoryIndex::HNSWMemoryIndex(const string & name, const string & options)
   m_type              = m_optionsMap.getOption("type"); // Supports HNSW and HNSW_BV
   m_incrUpdates       = m_optionsMap.getOption("online") == "Y";
   m_incrRefresh       = m_optionsMap.getOption("track").length() > 0;
+  m_docidCol          = m_optionsMap.getOption("docid");
+  m_reorderBFS        = m_optionsMap.getOption("reorder") == "bfs";
+  m_layoutSplit       = m_optionsMap.getOption("layout") == "split";
+
+  size_t hugePageSize = 0;
+  if (m_optionsMap.getOption("hugepages") == "Y")
+    hugePageSize = hnswlib::INDEX_MEMORY_PAGE_2M;
+  else if (m_optionsMap.getOption("hugepages") == "1G")
+    hugePageSize = hnswlib::INDEX_MEMORY_PAGE_1G;
+
+  hnswlib::IndexMemory::NumaPolicy numa;
+  int numaNode = -1;
+  if (!hnswlib::IndexMemory::parseNumaOption(m_optionsMap.getOption("numa"), numa, numaNode)) {
+    warning_print("HNSW index %s : invalid numa=%s, the default memory policy is used.",
+                  name.c_str(), m_optionsMap.getOption("numa").c_str());
+    numa     = hnswlib::IndexMemory::NUMA_DEFAULT;
+    numaNode = -1;
+  }
+  m_memory = make_shared<hnswlib::IndexMemory>(hugePageSize, numa, numaNode);
+
+  if (numa == hnswlib::IndexMemory::NUMA_NODE &&
+      m_optionsMap.getOption("numa_pin") == "Y") {
+    m_numaPin = hnswlib::NodeAffinityGuard::nodeCpus(numaNode, m_numaCpus);
+    if (!m_numaPin)
+      warning_print("HNSW index %s : CPUs of NUMA node %d not found, searches "
+                    "will not be pinned.", name.c_str(), numaNode);
+  }
 
   m_dist              = "L2";
 
@@ -725,6 +1060,10 @@ HNSWMemoryIndex::HNSWMemoryIndex(const string & name, const string & options)
 
 HNSWMemoryIndex::~HNSWMemoryIndex()
 {
+    stopCalibration(); /// calibration uses m_alg_hnsw
+    try {
+        waitBatches(0); /// failed build, batches use m_alg_hnsw
+    } catch (...) { }
     if (m_alg_hnsw)
         delete m_alg_hnsw;
     if (m_space)
@@ -735,13 +1074,22 @@ bool HNSWMemoryIndex::initIndex()
 {
   debug_print("hnsw initIndexO %p %s %d %d %d %d %d", this, m_name.c_str(), m_dim,
                m_size, m_ef_construction, m_ef_search, m_M);
+  stopCalibration();
+  if (m_alg_hnsw) delete m_alg_hnsw;
+  if (m_space)    delete m_space;
+
   m_space    = getSpace(m_dim);
+  m_mvspace  = dynamic_cast<hnswlib::BaseMultiVectorSpace<KeyTypeInteger>*>(m_space);
 
   m_alg_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(m_space, m_size,
-                     m_M, m_ef_construction);
+                     m_M, m_ef_construction, 100, false, m_layoutSplit,
+                     m_memory);
 
   (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->setEf(m_ef_search);
 
+  /* New index - written in full by the "build" save, no checkpoint lists */
+  (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->setBulkBuild(true);
+
   m_n_rows = 0;
   m_n_searches = 0;
 
@@ -782,7 +1130,8 @@ bool HNSWMemoryIndex::saveIndex(const string &path, const string &option)
   //lockExclusive();
 
   if (m_isParallelBuild) {
-     flushBatchSerial(); // last batch, maybe small
+     flushBatch(); // last batch, maybe small
+     waitBatches(0);
   }
 
   debug_print("HNSWemoryIndex::saveIndex %s %s.", path.c_str(), option.c_str());
@@ -802,9 +1151,31 @@ bool HNSWMemoryIndex::saveIndex(const string &path, const string &option)
     dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
   alg_hnsw->setCheckPointId(checkPointStr);
 
-  if (option == "build") {
+  /* A bulk built index has no checkpoint lists, it is always written in full.
+   * "build_reorder" is the save at the end of a base table build.
+   */
+  if (option == "build" || option == "build_reorder" || alg_hnsw->isBulkBuild()) {
+    /* The full write below persists the new node order. Incremental
+     * checkpoints write nodes in place, so the order is fixed after this.
+     * Only a graph that is not searched or updated yet can be renumbered.
+     */
+    stopCalibration(); /// reorderNodes() renumbers the nodes it samples
+    if (m_reorderBFS && option == "build_reorder") {
+      m_searchGate.close();
+      alg_hnsw->reorderNodes();
+      m_searchGate.open();
+    }
+
     // hnswlib method for full write/rewrite. Expect 10GB to take 10 secs. 
     alg_hnsw->saveIndex(filename);
+    alg_hnsw->setBulkBuild(false); /// updates from here are checkpointed
+
+    /* new graph, recall calibration has to be redone */
+    {
+      lock_guard<std::mutex> l(m_calibMutex);
+      m_calibration.clear();
+    }
+    unlink(calibrationFileName(path).c_str());
   } else {
     // "refresh" or "checkpoint" - special MyVector incremental persistence.
     alg_hnsw->doCheckPoint(filename);
@@ -822,6 +1193,7 @@ bool HNSWMemoryIndex::saveIndexIncr(const string &path, const string &option) {
 
 bool HNSWMemoryIndex::loadIndex(const string & path)
 {
+  stopCalibration();
   if (m_alg_hnsw) delete m_alg_hnsw;
   if (m_space)    delete m_space;
 
@@ -829,6 +1201,7 @@ bool HNSWMemoryIndex::loadIndex(const string & path)
   m_space    = nullptr;
 
   m_space    = getSpace(m_dim);
+  m_mvspace  = dynamic_cast<hnswlib::BaseMultiVectorSpace<KeyTypeInteger>*>(m_space);
   
   string indexfile = path + "/" + m_name + ".hnsw.index";
   
@@ -838,7 +1211,8 @@ bool HNSWMemoryIndex::loadIndex(const string & path)
   /* hnswlib throws std::runtime_error for errors */
   m_alg_hnsw = nullptr;
   try {
-    m_alg_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(m_space, indexfile);
+    m_alg_hnsw = new hnswlib::HierarchicalDiskNSW<FP32>(m_space, indexfile,
+                                                        false, 0, false, m_memory);
   } catch (std::runtime_error &e) {
       warning_print("Error loading hnsw index (%s) from file : %s",
                     m_name.c_str(), e.what());
@@ -869,6 +1243,7 @@ bool HNSWMemoryIndex::loadIndex(const string & path)
       setLastUpdateCoordinates(binlogFile, binlogPosition);
     }
 
+    loadCalibration(path);
   }
 
   debug_print("debug HNSW index %s from %s",
@@ -879,7 +1254,9 @@ bool HNSWMemoryIndex::loadIndex(const string & path)
 
 bool HNSWMemoryIndex::dropIndex(const string & path)
 {
-    /* Force drop index - delete files and free memory */
+    /* Force drop index - delete files. Memory is freed by the destructor,
+     * queries that hold the index can still be running.
+     */
     string indexfile = path + "/" + m_name + ".hnsw.index";
     unlink(indexfile.c_str());
     string linksfile = path + "/" + m_name + ".hnsw.index.links";
@@ -888,12 +1265,8 @@ bool HNSWMemoryIndex::dropIndex(const string & path)
     unlink(linksdatafile.c_str());
     string statusfile = path + "/" + m_name + ".hnsw.index.status";
     unlink(statusfile.c_str());
-
-    if (m_alg_hnsw) delete m_alg_hnsw;
-    m_alg_hnsw = nullptr;
-
-    if (m_space)    delete m_space;
-    m_space    = nullptr;
+    unlink(calibrationFileName(path).c_str());
+    dropBuildState(path);
 
     return true;
 }
@@ -905,11 +1278,18 @@ bool HNSWMemoryIndex::closeIndex()
 
 void HNSWMemoryIndex::setSearchEffort(int ef_search)
 {
+    m_ef_search = ef_search;
     (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->setEf(ef_search);
 }
     
 hnswlib::SpaceInterface<float>* HNSWMemoryIndex::getSpace(size_t dim)
 {
+    /* Multi-vector : same distances, data is vector + doc id */
+    if (m_type == "HNSW" && m_docidCol.length() && m_dist == "L2")
+        return new hnswlib::MultiVectorL2Space<KeyTypeInteger>(m_dim);
+    else if (m_type == "HNSW" && m_docidCol.length() && m_dist == "CosineNorm")
+        return new hnswlib::MultiVectorInnerProductSpace<KeyTypeInteger>(m_dim);
+
     if (m_type == "HNSW"  && m_dist == "L2")
         return new hnswlib::L2Space(m_dim);
     else if (m_type == "HNSW" && m_dist == "CosineNorm")
@@ -933,25 +1313,69 @@ string HNSWMemoryIndex::getStatus()
     ss << "Type : " << m_type << endl;
     ss << "Dimension : " << m_dim << endl;
     ss << "Distance : " << m_optionsMap.getOption("dist") << endl;
+    if (m_docidCol.length())
+        ss << "Document Id Column : " << m_docidCol << endl;
     ss << "Max. Capacity : " << m_size << endl;
     ss << "M = " << m_M << endl;
+    ss << "Memory Pages : " << m_memory->describePages() << endl;
+    ss << "NUMA Placement : " << m_memory->describeNuma()
+       << (m_numaPin ? ", searches pinned" : "") << endl;
+    if (m_reorderBFS)
+        ss << "Node Order : bfs" << endl;
+    if (m_buildSecs > 0)
+        ss << "Last Build : " << m_buildRows << " rows in " << m_buildSecs << " secs ("
+           << (unsigned long)(m_buildRows / m_buildSecs) << " rows/sec)" << endl;
 
     if (m_alg_hnsw)
     {
         ss << "Element Data Size : " << (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->size_data_per_element_ << endl;
+        ss << "Level 0 Layout : " << ((dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->split_layout_ ? "split" : "interleaved") << endl;
         ss << "Current Rows : " << (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->cur_element_count << endl;
+        ss << "Upper Level Links Memory : " << (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->getLinkListMemory() << endl;
         ss << "Searches : " << m_n_searches << endl;
+        ss << "Visited List Memory : " << (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->getVisitedListMemory()
+           << ((dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->isVisitedListSparse() ? " (sparse)" : " (dense)") << endl;
+    }
+
+    {
+        lock_guard<std::mutex> l(m_calibMutex);
+        for (auto & c : m_calibration)
+            ss << "Recall Calibration : target_recall=" << (c.first.first / 1000.0)
+               << " ef=" << c.first.second << " patience=" << c.second << endl;
     }
 
     return ss.str();
 }
 
 
-bool HNSWMemoryIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n)
+bool HNSWMemoryIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n,
+                                     const VectorSearchParams & params)
 {
+    size_t ef = (params.ef_search > 0 ? params.ef_search : m_ef_search);
+    hnswlib::NodeAffinityGuard pin(m_numaPin ? &m_numaCpus : nullptr);
+    SearchGateGuard gate(m_searchGate);
+
+    if (params.target_recall > 0) {
+        /* Adaptive early termination, ef is the ceiling */
+        hnswlib::AdaptiveSearchStopCondition<FP32> stop_condition(n, max(ef, (size_t)n),
+                                     getPatience(params.target_recall, ef));
+
+        vector<pair<FP32, hnswlib::labeltype>> result =
+          (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->searchStopConditionClosest(
+                                                                qvec, stop_condition);
+        keys.clear();
+        tls_distances->clear();
+        for (auto & r : result) /// already nearest to farthest
+        {
+            keys.push_back(r.second);
+            (*tls_distances)[r.second] = r.first; /// pkid -> distance
+        }
+        m_n_searches++;
+        return true;
+    }
 
     priority_queue<pair<FP32, hnswlib::labeltype>> result =
-                            m_alg_hnsw->searchKnn(qvec, n);
+      (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->searchKnnEf(qvec, n, ef);
 
     keys.clear();
     tls_distances->clear();
@@ -967,219 +1391,1211 @@ bool HNSWMemoryIndex::searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInte
     return true;
 }
 
-void HNSWMemoryIndex::getLastUpdateCoordinates(string &binlogFile,
-                                               size_t &binlogPosition) {
-  binlogFile     = m_binlogFile;
-  binlogPosition = m_binlogPosition;
-}
-
-void HNSWMemoryIndex::setLastUpdateCoordinates(const string &binlogFile,
-                                               const size_t &binlogPosition) {
-  m_binlogFile       = binlogFile;
-  m_binlogPosition   = binlogPosition;
-  debug_print("setLastUpdateCoordinates %s %lu", binlogFile.c_str(), binlogPosition);
-}
-
-
-// Parallel HNSW index load (hnswlib:example_search_mt.cpp)
-template<class Function>
-inline void ParallelFor(size_t start, size_t end, size_t numThreads, Function fn) {
-    debug_print("Entered ParallelFor %lu %lu t=%lu", start, end, numThreads);
-    if (numThreads <= 0) {
-        numThreads = thread::hardware_concurrency();
-    }
-
-    if (numThreads == 1) {
-        for (size_t id = start; id < end; id++) {
-            fn(id, 0);
-        }
-    } else {
-        vector<thread> threads;
-        atomic<size_t> current(start);
-
-        // keep track of exceptions in threads
-        // https://stackoverflow.com/a/32428427/1713196
-        exception_ptr lastException = nullptr;
-        mutex lastExceptMutex;
-
-        for (size_t threadId = 0; threadId < numThreads; ++threadId) {
-            threads.push_back(thread([&, threadId] {
-                while (true) {
-                    size_t id = current.fetch_add(1);
-
-                    if (id >= end) {
-                        break;
-                    }
-
-                    try {
-                        fn(id, threadId);
-                    } catch (...) {
-                        unique_lock<mutex> lastExcepLock(lastExceptMutex);
-                        lastException = current_exception();
-                        /*
-                         * This will work even when current is the largest value that
-                         * size_t can fit, because fetch_add returns the previous value
-                         * before the increment (what will result in overflow
-                         * and produce 0 instead of current + 1).
-                         */
-                        current = end;
-                        break;
-                    }
-                }
-            }));
-        }
-        for (auto &thread : threads) {
-            thread.join();
-        }
-        if (lastException) {
-            rethrow_exception(lastException);
-        }
-    }
-}
-
-bool HNSWMemoryIndex::startParallelBuild(int nthreads)
+/* searchVectorRange - radius search using hnswlib EpsilonSearchStopCondition.
+ * The traversal keeps expanding while candidates are inside the radius, so a
+ * single search returns all near-duplicates without guessing a 'nn'. At least
+ * ef_search candidates are examined before the search can stop.
+ */
+bool HNSWMemoryIndex::searchVectorRange(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys,
+                                        double radius, int maxn,
+                                        const VectorSearchParams & params)
 {
-  m_batch.clear(); m_batchkeys.clear();
-  m_isParallelBuild = true;
-  m_threads = nthreads;
-  return true;
-}
+    int ef = (params.ef_search > 0 ? params.ef_search : m_ef_search);
+    hnswlib::NodeAffinityGuard pin(m_numaPin ? &m_numaCpus : nullptr);
+    SearchGateGuard gate(m_searchGate);
 
-bool HNSWMemoryIndex::flushBatchSerial() {
-  debug_print("flushBatchSerial %lu", m_batchkeys.size());
-  for (unsigned int i = 0; i < m_batchkeys.size(); i++) {
-    m_alg_hnsw->addPoint((void *)&(m_batch[i * m_space->get_data_size()]), m_batchkeys[i]);
-  }
-  return true;
-}
+    hnswlib::EpsilonSearchStopCondition<FP32> stop_condition(radius,
+                                              min(ef, maxn), maxn);
 
-bool HNSWMemoryIndex::flushBatchParallel() {
-    debug_print("Entered flushBatchParallel for (%s), nthreads = %d, sz = %u",
-                m_name.c_str(), m_threads, m_batchkeys.size());
-    /* Add data to index - HNSW multi-threaded example from 
-     * hnswlib:example_search_mt.cpp.
-     */
-    ParallelFor(0, m_batchkeys.size(), m_threads, [&](size_t row, size_t threadId) {
-        m_alg_hnsw->addPoint((void*)&(m_batch[row * m_space->get_data_size()]), m_batchkeys[row]);
-    });
+    vector<pair<FP32, hnswlib::labeltype>> result =
+      (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->searchStopConditionClosest(
+                                                                qvec, stop_condition);
 
-    m_batch.clear();
-    m_batchkeys.clear();
+    keys.clear();
+    tls_distances->clear();
+    for (auto & r : result) /// already nearest to farthest
+    {
+        keys.push_back(r.second);
+        (*tls_distances)[r.second] = r.first; /// pkid -> distance
+    }
 
+    m_n_searches++;
     return true;
 }
 
-bool HNSWMemoryIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
-  FP32 *fvec = static_cast<FP32 *>(vec);
-  if (m_isParallelBuild) {
-    //m_batch.insert(m_batch.end(), fvec, fvec + m_dim);
-    m_batch.insert(m_batch.end(), (char *)vec, ((char *)vec + m_space->get_data_size()));
-    m_batchkeys.push_back(id);
-
-    if (m_batchkeys.size() == HNSW_PARALLEL_BUILD_UNIT_SIZE) {
-      flushBatchParallel();
+/* DocIdStopCondition - hnswlib MultiVectorSearchStopCondition that also
+ * remembers the doc id of every vector it accepts, the final result list
+ * only has labels (row ids).
+ */
+class DocIdStopCondition :
+  public hnswlib::MultiVectorSearchStopCondition<KeyTypeInteger, FP32>
+{
+public:
+    DocIdStopCondition(hnswlib::BaseMultiVectorSpace<KeyTypeInteger> & space,
+                       size_t ndocs, size_t ef)
+      : hnswlib::MultiVectorSearchStopCondition<KeyTypeInteger, FP32>(space, ndocs, ef),
+        m_space(space) {}
+
+    void add_point_to_result(hnswlib::labeltype label, const void *datapoint,
+                             FP32 dist) override {
+      m_docids[label] = m_space.get_doc_id(datapoint);
+      hnswlib::MultiVectorSearchStopCondition<KeyTypeInteger, FP32>::add_point_to_result(
+                                                                label, datapoint, dist);
     }
-  } else {
-    m_alg_hnsw->addPoint(fvec, id);
-  }
-
-  m_n_rows++; // atomic
-  m_isDirty = true;
-  return true;
-}
 
+    KeyTypeInteger getDocId(hnswlib::labeltype label) { return m_docids[label]; }
 
-class SharedLockGuard {
-  public:
-    SharedLockGuard(AbstractVectorIndex *h_index) : m_index(h_index) {}
-    ~SharedLockGuard() { if (m_index) m_index->unlockShared(); }
-    void clear() { m_index = nullptr; }
-  private:
-     AbstractVectorIndex *m_index{nullptr};
+private:
+    hnswlib::BaseMultiVectorSpace<KeyTypeInteger> & m_space;
+    unordered_map<hnswlib::labeltype, KeyTypeInteger> m_docids;
 };
 
-AbstractVectorIndex* VectorIndexCollection::open(const string &name,
-                const string &options, const string &useraction) {
-
-  lock_guard<mutex> l(m_mutex); // exclusive
+/* searchVectorDocs - multi-vector search. A single traversal collects the
+ * vectors of the 'ndocs' nearest documents, results are then collapsed to
+ * one entry per document with its nearest vector distance.
+ */
+bool HNSWMemoryIndex::searchVectorDocs(VectorPtr qvec, int dim, vector<KeyTypeInteger> & docids,
+                                       int ndocs, const VectorSearchParams & params)
+{
+    if (!m_mvspace)
+        return false;
 
-  debug_print("Opening new index %s %s %s", name.c_str(), options.c_str(), useraction.c_str());
+    int ef = (params.ef_search > 0 ? params.ef_search : m_ef_search);
+    hnswlib::NodeAffinityGuard pin(m_numaPin ? &m_numaCpus : nullptr);
+    SearchGateGuard gate(m_searchGate);
 
-  AbstractVectorIndex *hnewindex = nullptr;
+    DocIdStopCondition stop_condition(*m_mvspace, ndocs, max(ef, ndocs));
 
-  /* First case handles both HNSW and HNSW_BV */
-  if (options.rfind("type=HNSW") != string::npos) {
-    hnewindex = new HNSWMemoryIndex(name, options);
-  }
-  else if (options.rfind("type=KNN") != string::npos) {
-    hnewindex = new KNNIndex(name, options);
-  }
-  else {
-    my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
-      "MyVector unknown index type for %s options = %s, using KNN",
-      name.c_str(), options.c_str());
-    hnewindex = new KNNIndex(name, options);
-  }
+    vector<pair<FP32, hnswlib::labeltype>> result =
+      (dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw))->searchStopConditionClosest(
+                                                                qvec, stop_condition);
 
-  m_indexes[name] = hnewindex;
+    docids.clear();
+    tls_distances->clear();
+    for (auto & r : result) /// nearest to farthest, first hit of a doc is its best
+    {
+        KeyTypeInteger docid = stop_condition.getDocId(r.second);
+        if (tls_distances->find(docid) != tls_distances->end())
+            continue;
+        docids.push_back(docid);
+        (*tls_distances)[docid] = r.first; /// docid -> distance
+    }
 
-  return hnewindex;
+    m_n_searches++;
+    return true;
 }
 
-AbstractVectorIndex* VectorIndexCollection::get(const string &name)
+/* getPatience - patience of AdaptiveSearchStopCondition for a recall
+ * target and ef. A new (target, ef) is calibrated in the background by the
+ * worker pool, till then the search stops only at the ef ceiling.
+ */
+size_t HNSWMemoryIndex::getPatience(double target_recall, size_t ef)
 {
-  lock_guard<mutex> l(m_mutex);
-  AbstractVectorIndex *hindex = nullptr;
-  if (m_indexes.find(name) != m_indexes.end()) {
-    hindex = m_indexes[name];
-    hindex->lockShared(); /* acquire lock before returning from here */
-  }
-  else {  
-    my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
-      "VectorIndexCollection::get() index not found %s", name.c_str());
-  }
+    int target = (int)lround(min(target_recall, 1.0) * 1000);
+    pair<int, size_t> key(target, ef);
+
+    lock_guard<std::mutex> l(m_calibMutex);
+    auto it = m_calibration.find(key);
+    if (it != m_calibration.end())
+        return it->second;
+
+    m_calibPending.insert(key);
+    if (!m_calibRunning && !m_calibStop) {
+        m_calibRunning = true;
+        m_calibTask    = myvector_worker_pool().submit([this] { calibratePending(); });
+    }
 
-  return hindex;
+    return ef;
 }
 
-bool VectorIndexCollection::close(AbstractVectorIndex *hindex)
+/* calibratePending - worker pool task, calibrates the pending (target, ef)
+ * pairs one at a time and saves the results.
+ */
+void HNSWMemoryIndex::calibratePending()
 {
-  lock_guard<mutex> l(m_mutex);
-
-  hindex->unlockShared(); /* taken when opening the index */
+    while (true) {
+        pair<int, size_t> key;
+        {
+            lock_guard<std::mutex> l(m_calibMutex);
+            if (m_calibPending.empty() || m_calibStop) {
+                m_calibRunning = false;
+                return;
+            }
+            key = *m_calibPending.begin();
+        }
 
-  hindex->lockExclusive(); /* wait for all readers to drain */
-  hindex->closeIndex();
-  m_indexes.erase(m_indexes.find(hindex->getName()));
-  hindex->unlockExclusive();
+        size_t patience = calibrate(key.first / 1000.0, key.second);
 
-  delete hindex; /* no other thread can hold shared lock */
-  return true;
+        lock_guard<std::mutex> l(m_calibMutex);
+        if (!m_calibStop) {
+            m_calibration[key] = patience;
+            saveCalibration(myvector_index_dir);
+        }
+        m_calibPending.erase(key);
+    }
 }
 
-/* FindEarliestBinlogFile() - Find the oldest binlog file from all
- * the "online" vector indexes checkpoint info.
+/* stopCalibration - cancel and wait for the calibration task, before the
+ * graph is replaced, renumbered or freed.
  */
-string VectorIndexCollection::FindEarliestBinlogFile() {
-  string ret = "";
-  for (auto entry : m_indexes) {
-    string binlogfile;
-    size_t binlogpos;
-    if (entry.second->supportsIncrUpdates()) {
-      entry.second->getLastUpdateCoordinates(binlogfile, binlogpos);
-      if (ret == "") 
-        ret = binlogfile;
-      else if (binlogfile < ret)
-        ret = binlogfile;
+void HNSWMemoryIndex::stopCalibration()
+{
+    future<void> task;
+    {
+        lock_guard<std::mutex> l(m_calibMutex);
+        m_calibStop = true;
+        m_calibPending.clear();
+        task = std::move(m_calibTask);
     }
-  }
-  if (ret == "zzzzzz.bin")
-    ret = "";
-  debug_print("FindEarliestBinlogFile : %s.", ret.c_str());
-  return ret;
+    if (task.valid())
+        task.wait();
+
+    lock_guard<std::mutex> l(m_calibMutex);
+    m_calibRunning = false;
+    m_calibStop    = false;
 }
 
-static VectorIndexCollection g_indexes;
+/* calibrate - find the smallest patience that reaches 'target_recall'.
+ * Queries are held out : a query is made from a sample stored vector, which
+ * is not counted in its neighbours. FP32 vectors are also perturbed, so that
+ * the search does not just walk to the stored copy. The true neighbours are
+ * found by brute force. If the target cannot be met, patience is ef i.e the
+ * search stops only at the ef ceiling.
+ */
+size_t HNSWMemoryIndex::calibrate(double target_recall, size_t ef)
+{
+    hnswlib::HierarchicalDiskNSW<FP32> *alg_hnsw =
+      dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+
+    /* Elements published when calibration starts. Inserts run meanwhile :
+     * addPoint() holds the label's op lock till the element is written, so
+     * a vector is read under that lock.
+     */
+    vector<pair<hnswlib::tableint, KeyTypeInteger>> elements;
+    {
+        lock_guard<std::mutex> l(alg_hnsw->label_lookup_lock);
+        elements.reserve(alg_hnsw->label_lookup_.size());
+        for (auto & e : alg_hnsw->label_lookup_)
+            elements.emplace_back(e.second, e.first);
+    }
+    sort(elements.begin(), elements.end());
+
+    size_t nrows = elements.size();
+    if (nrows < 2)
+        return ef;
+
+    size_t nq       = min(nrows, (size_t)HNSW_CALIBRATION_QUERIES);
+    size_t k        = min(nrows - 1, (size_t)HNSW_CALIBRATION_K);
+    size_t dataSize = m_space->get_data_size();
+    bool   perturb  = (m_type == "HNSW" && !m_mvspace); /// plain FP32 vectors
+
+    /* readElement - copy the vector of elements[e], false if it is deleted
+     * or its slot has been reused for another label since the snapshot.
+     */
+    auto readElement = [&](size_t e, char *data) {
+        lock_guard<std::mutex> l(alg_hnsw->getLabelOpMutex(elements[e].second));
+        if (alg_hnsw->getExternalLabel(elements[e].first) != elements[e].second ||
+            alg_hnsw->isMarkedDeleted(elements[e].first))
+            return false;
+        memcpy(data, alg_hnsw->getDataByInternalId(elements[e].first), dataSize);
+        return true;
+    };
+
+    mt19937 rng(nrows);
+    uniform_int_distribution<size_t> pick(0, nrows - 1);
+    normal_distribution<FP32>        noise(0.0, 1.0);
+
+    vector<char>           queries(nq * dataSize);
+    vector<KeyTypeInteger> qlabels(nq);
+    size_t                 nsampled = 0;
+    for (size_t q = 0; q < nq; q++) {
+        size_t e = pick(rng);
+        if (!readElement(e, &queries[nsampled * dataSize]))
+            continue;
+        qlabels[nsampled] = elements[e].second;
+
+        if (perturb) {
+            FP32  *qvec = (FP32 *)&queries[nsampled * dataSize];
+            double norm = 0;
+            for (int d = 0; d < m_dim; d++)
+                norm += qvec[d] * qvec[d];
+            FP32 sigma = HNSW_CALIBRATION_NOISE * sqrt(norm / m_dim);
+            for (int d = 0; d < m_dim; d++)
+                qvec[d] += sigma * noise(rng);
+        }
+        nsampled++;
+    }
+    nq = nsampled;
+    if (nq == 0)
+        return ef;
+
+    /* Brute force k nearest of each query, a max heap of the nearest so far */
+    vector<priority_queue<pair<FP32, KeyTypeInteger>>> nearest(nq);
+    vector<char> data(dataSize);
+    for (size_t e = 0; e < nrows; e++) {
+        if (m_calibStop)
+            return ef;
+        if (!readElement(e, data.data()))
+            continue;
+        KeyTypeInteger label = elements[e].second;
+        for (size_t q = 0; q < nq; q++) {
+            if (label == qlabels[q])
+                continue;
+            FP32 dist = alg_hnsw->fstdistfunc_(&queries[q * dataSize], data.data(),
+                                               alg_hnsw->dist_func_param_);
+            if (nearest[q].size() < k)
+                nearest[q].emplace(dist, label);
+            else if (dist < nearest[q].top().first) {
+                nearest[q].pop();
+                nearest[q].emplace(dist, label);
+            }
+        }
+    }
+
+    vector<unordered_set<KeyTypeInteger>> truth(nq);
+    for (size_t q = 0; q < nq; q++) {
+        while (!nearest[q].empty()) {
+            truth[q].insert(nearest[q].top().second);
+            nearest[q].pop();
+        }
+    }
+
+    size_t patience = ef;
+    for (size_t p : HNSW_ADAPTIVE_PATIENCE) {
+        if (p >= ef)
+            break;
+
+        /* k + 1 neighbours, the query's own vector is dropped */
+        size_t hits = 0, total = 0;
+        for (size_t q = 0; q < nq; q++) {
+            if (m_calibStop)
+                return ef;
+            hnswlib::AdaptiveSearchStopCondition<FP32> stop_condition(k + 1, max(ef, k + 1), p);
+            auto result = alg_hnsw->searchStopConditionClosest(&queries[q * dataSize],
+                                                               stop_condition);
+            size_t nres = 0;
+            for (auto & r : result) {
+                if ((KeyTypeInteger)r.second == qlabels[q])
+                    continue;
+                if (nres++ == k)
+                    break;
+                hits += truth[q].count(r.second);
+            }
+            total += truth[q].size();
+        }
+
+        if (total && ((double)hits / total) >= target_recall) {
+            patience = p;
+            break;
+        }
+    }
+
+    info_print("HNSW index %s calibrated target_recall=%.3f, patience=%lu (ef=%lu, %lu queries).",
+               m_name.c_str(), target_recall, patience, ef, nq);
+    return patience;
+}
+
+/* Calibration file format : one line per recall target and ef,
+ * <target recall per mille> <ef> <patience>
+ * Lines with no ef (older files) are not loaded, these are recalibrated.
+ */
+void HNSWMemoryIndex::loadCalibration(const string & path)
+{
+    ifstream calib(calibrationFileName(path));
+    if (!calib.is_open())
+        return;
+
+    lock_guard<std::mutex> l(m_calibMutex);
+    m_calibration.clear();
+    string line;
+    while (getline(calib, line)) {
+        istringstream fields(line);
+        int    target   = 0;
+        size_t ef = 0, patience = 0;
+        if (fields >> target >> ef >> patience)
+            m_calibration[make_pair(target, ef)] = patience;
+    }
+}
+
+void HNSWMemoryIndex::saveCalibration(const string & path)
+{
+    string filename = calibrationFileName(path);
+    string tmpname  = filename + ".tmp";
+
+    ofstream calib(tmpname, ios::trunc);
+    if (!calib.is_open()) {
+        warning_print("HNSW index %s : cannot write %s.", m_name.c_str(), tmpname.c_str());
+        return;
+    }
+    for (auto & c : m_calibration)
+        calib << c.first.first << " " << c.first.second << " " << c.second << "\n";
+    calib.close();
+
+    rename(tmpname.c_str(), filename.c_str());
+}
+
+/* Files of a HNSW graph written by HierarchicalDiskNSW::saveIndex() */
+static const char *HNSW_INDEX_FILE_SUFFIXES[] = { "", ".links", ".links.data", ".status" };
+
+/* saveBuildState - the partial graph is written to <index>.build and the
+ * last base table key and the binlog position to <index>.build.state. The
+ * graph is written to .tmp files and renamed with no state file in place, so
+ * that a failure leaves either no partial build or a graph with all rows up
+ * to its key.
+ */
+bool HNSWMemoryIndex::saveBuildState(const string & path, KeyTypeInteger lastKey,
+                                     const string & binlogFile, size_t binlogPos)
+{
+    if (m_isParallelBuild) {
+        flushBatch();
+        waitBatches(0);
+    }
+
+    string filename = buildFileName(path);
+    string tmpname  = filename + ".tmp";
+    try {
+        dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)->saveIndex(tmpname);
+    } catch (std::runtime_error &e) {
+        warning_print("HNSW index %s : cannot save partial build : %s.",
+                      m_name.c_str(), e.what());
+        return false;
+    }
+
+    string statename = filename + ".state";
+    unlink(statename.c_str());
+    for (auto suffix : HNSW_INDEX_FILE_SUFFIXES)
+        rename((tmpname + suffix).c_str(), (filename + suffix).c_str());
+
+    ofstream state(statename + ".tmp", ios::trunc);
+    if (!state.is_open()) {
+        warning_print("HNSW index %s : cannot write %s.tmp.", m_name.c_str(), statename.c_str());
+        return false;
+    }
+    state << "lastkey=" << lastKey << ",binlogfile=" << binlogFile
+          << ",binlogpos=" << binlogPos << "\n";
+    state.close();
+    rename((statename + ".tmp").c_str(), statename.c_str());
+
+    debug_print("HNSW index %s : partial build saved at key %lu, rows %lu.",
+                m_name.c_str(), lastKey, (unsigned long)m_n_rows);
+    return true;
+}
+
+/* loadBuildState - load a partial graph to resume its build, returns false
+ * if there is none. binlogFile is "" for a state file with no position.
+ */
+bool HNSWMemoryIndex::loadBuildState(const string & path, KeyTypeInteger & lastKey,
+                                     string & binlogFile, size_t & binlogPos)
+{
+    string  filename = buildFileName(path);
+    string  line;
+    ifstream state(filename + ".state");
+    if (!state.is_open() || !getline(state, line) ||
+        !MyVectorOptions(line).getOption("lastkey").length())
+        return false;
+    MyVectorOptions so(line);
+    lastKey    = strtoull(so.getOption("lastkey").c_str(), nullptr, 10);
+    binlogFile = so.getOption("binlogfile");
+    binlogPos  = strtoull(so.getOption("binlogpos").c_str(), nullptr, 10);
+
+    hnswlib::HierarchicalDiskNSW<FP32> *alg = nullptr;
+    hnswlib::SpaceInterface<float>     *space = getSpace(m_dim);
+    try {
+        alg = new hnswlib::HierarchicalDiskNSW<FP32>(space, filename,
+                                                     false, 0, false, m_memory);
+    } catch (std::runtime_error &e) {
+        warning_print("HNSW index %s : cannot load partial build : %s.",
+                      m_name.c_str(), e.what());
+        delete space;
+        return false;
+    }
+
+    if (m_alg_hnsw) delete m_alg_hnsw;
+    if (m_space)    delete m_space;
+    m_alg_hnsw = alg;
+    m_space    = space;
+    m_mvspace  = dynamic_cast<hnswlib::BaseMultiVectorSpace<KeyTypeInteger>*>(m_space);
+
+    alg->setEf(m_ef_search);
+    alg->setBulkBuild(true); /// as initIndex()
+
+    m_n_rows     = alg->cur_element_count.load();
+    m_n_searches = 0;
+
+    setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
+    setUpdateTs(0);
+
+    return true;
+}
+
+void HNSWMemoryIndex::dropBuildState(const string & path)
+{
+    string filename = buildFileName(path);
+    unlink((filename + ".state").c_str());
+    for (auto suffix : HNSW_INDEX_FILE_SUFFIXES) {
+        unlink((filename + suffix).c_str());
+        unlink((filename + ".tmp" + suffix).c_str());
+    }
+}
+
+void HNSWMemoryIndex::getLastUpdateCoordinates(string &binlogFile,
+                                               size_t &binlogPosition) {
+  binlogFile     = m_binlogFile;
+  binlogPosition = m_binlogPosition;
+}
+
+void HNSWMemoryIndex::setLastUpdateCoordinates(const string &binlogFile,
+                                               const size_t &binlogPosition) {
+  m_binlogFile       = binlogFile;
+  m_binlogPosition   = binlogPosition;
+  debug_print("setLastUpdateCoordinates %s %lu", binlogFile.c_str(), binlogPosition);
+}
+
+
+/* startParallelBuild - inserts are queued in the worker pool from here, so
+ * that the rows are fetched while the earlier rows are added to the graph.
+ */
+bool HNSWMemoryIndex::startParallelBuild(int nthreads)
+{
+  m_batch.clear(); m_batchkeys.clear();
+  m_isParallelBuild = true;
+  m_threads = nthreads;
+  myvector_worker_pool().reserve(nthreads);
+  return true;
+}
+
+/* flushBatch - queue the rows in m_batch to be added by the worker pool */
+void HNSWMemoryIndex::flushBatch() {
+  if (m_batchkeys.empty())
+    return;
+
+  auto data = make_shared<vector<char>>();
+  auto keys = make_shared<vector<KeyTypeInteger>>();
+  data->swap(m_batch);
+  keys->swap(m_batchkeys);
+
+  hnswlib::AlgorithmInterface<FP32> *alg = m_alg_hnsw;
+  size_t dataSize = m_space->get_data_size();
+  m_batchesInFlight.push_back(myvector_worker_pool().submit([alg, data, keys, dataSize] {
+    for (size_t i = 0; i < keys->size(); i++)
+      alg->addPoint((void *)&((*data)[i * dataSize]), (*keys)[i]);
+  }));
+}
+
+/* waitBatches - wait till at most 'maxInFlight' batches are queued or being
+ * added. Rethrows the first error of a batch (e.g index is full) after all
+ * the batches are done.
+ */
+void HNSWMemoryIndex::waitBatches(size_t maxInFlight) {
+  exception_ptr error = nullptr;
+  while (m_batchesInFlight.size() > maxInFlight) {
+    future<void> f = std::move(m_batchesInFlight.front());
+    m_batchesInFlight.pop_front();
+    try {
+      f.get();
+    } catch (...) {
+      if (!error)
+        error = current_exception();
+      maxInFlight = 0;
+    }
+  }
+  if (error)
+    rethrow_exception(error);
+}
+
+bool HNSWMemoryIndex::insertVector(VectorPtr vec, int dim, KeyTypeInteger id) {
+  if (m_mvspace) /// no doc id, the row is a document by itself
+    return insertVectorDoc(vec, dim, id, id);
+  return insertData(vec, id);
+}
+
+/* insertVectorDoc - copy the vector and the doc id into the layout of the
+ * multi-vector space i.e <dim floats><doc id>.
+ */
+bool HNSWMemoryIndex::insertVectorDoc(VectorPtr vec, int dim, KeyTypeInteger id,
+                                      KeyTypeInteger docid) {
+  if (!m_mvspace)
+    return insertData(vec, id);
+
+  vector<char> data(m_space->get_data_size());
+  memcpy(data.data(), vec, m_dim * sizeof(FP32));
+  m_mvspace->set_doc_id(data.data(), docid);
+
+  return insertData(data.data(), id);
+}
+
+/* deleteVector - mark the vector of 'id' deleted, searches skip it. The
+ * mark is in the level 0 links and is checkpointed with them.
+ */
+bool HNSWMemoryIndex::deleteVector(KeyTypeInteger id) {
+  try {
+    dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw)->markDelete(id);
+  } catch (std::runtime_error &e) { /// not in the index, or already deleted
+    return false;
+  }
+  m_isDirty = true;
+  return true;
+}
+
+/* getKeys - keys of the vectors in the index that are not deleted */
+void HNSWMemoryIndex::getKeys(vector<KeyTypeInteger> & keys) {
+  hnswlib::HierarchicalDiskNSW<FP32> *alg =
+    dynamic_cast<hnswlib::HierarchicalDiskNSW<FP32>*>(m_alg_hnsw);
+  if (!alg)
+    return;
+
+  lock_guard<mutex> l(alg->label_lookup_lock);
+  for (auto & lk : alg->label_lookup_)
+    if (!alg->isMarkedDeleted(lk.second))
+      keys.push_back(lk.first);
+}
+
+/* insertData - add a vector in space data format to the HNSW graph */
+bool HNSWMemoryIndex::insertData(void *vec, KeyTypeInteger id) {
+  FP32 *fvec = static_cast<FP32 *>(vec);
+  if (m_isParallelBuild) {
+    //m_batch.insert(m_batch.end(), fvec, fvec + m_dim);
+    m_batch.insert(m_batch.end(), (char *)vec, ((char *)vec + m_space->get_data_size()));
+    m_batchkeys.push_back(id);
+
+    if (m_batchkeys.size() == HNSW_PARALLEL_BUILD_UNIT_SIZE) {
+      flushBatch();
+      waitBatches(m_threads * HNSW_PARALLEL_BUILD_UNITS_PER_THREAD);
+    }
+  } else {
+    m_alg_hnsw->addPoint(fvec, id);
+  }
+
+  m_n_rows++; // atomic
+  m_isDirty = true;
+  return true;
+}
+
+/* HNSWPartitionedIndex - HNSW index with option partition_by=<column>. Rows
+ * are routed into one smaller HNSWMemoryIndex per distinct value of the
+ * partition column (e.g tenant, language, category). A search that names a
+ * partition walks only that graph, so a filter on the partition column does
+ * not hurt recall. All partitions share the index checkpoint coordinates
+ * and are saved/loaded/dropped together. The list of partition values is
+ * kept in <index>.hnsw.partitions, partition N is stored in the usual HNSW
+ * files named <index>.pN.hnsw.index*.
+ *
+ * Capacity of each partition is given by psize=<n> (default is size=<n>).
+ */
+class HNSWPartitionedIndex : public AbstractVectorIndex
+{
+public:
+    HNSWPartitionedIndex(const string & name, const string & options);
+
+    ~HNSWPartitionedIndex();
+
+    bool        supportsIncrUpdates() { return m_incrUpdates; }
+    bool        supportsIncrRefresh() { return m_incrRefresh; }
+    bool        supportsConcurrentUpdates() { return true; } /// unless startParallelBuild()
+    bool        isDirty()             { return m_isDirty; }
+
+    bool saveIndex(const string & path, const string & option);
+
+    bool saveIndexIncr(const string & /*path*/, const string & /*option*/) { return true; }
+
+    bool loadIndex(const string & path);
+
+    bool dropIndex(const string & path);
+
+    bool initIndex();
+
+    bool closeIndex() { return true; }
+
+    string getName() { return m_name; }
+
+    string getType() { return m_type; }
+
+    string getStatus();
+
+    bool searchVectorNN(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys, int n,
+                        const VectorSearchParams & params = VectorSearchParams());
+
+    bool searchVectorRange(VectorPtr qvec, int dim, vector<KeyTypeInteger> & keys,
+                           double radius, int maxn,
+                           const VectorSearchParams & params = VectorSearchParams());
+
+    bool searchVectorDocs(VectorPtr qvec, int dim, vector<KeyTypeInteger> & docids,
+                          int ndocs,
+                          const VectorSearchParams & params = VectorSearchParams());
+
+    bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id);
+
+    bool insertVectorDoc(VectorPtr vec, int dim, KeyTypeInteger id, KeyTypeInteger docid);
+
+    string getDocIdColumn() { return m_optionsMap.getOption("docid"); }
+
+    int getDimension()                  { return m_dim; }
+
+    void setUpdateTs(unsigned long ts)  { m_updateTs = ts; }
+
+    unsigned long getUpdateTs()         { return m_updateTs; }
+
+    unsigned long getRowCount();
+
+    void setBuildStats(unsigned long rows, double secs)
+        { m_buildRows = rows; m_buildSecs = secs; }
+
+    bool startParallelBuild(int nthreads);
+
+    void getLastUpdateCoordinates(string & binlogFile, size_t & binlogPos);
+    void setLastUpdateCoordinates(const string & binlogFile, const size_t & binlogPos);
+
+    void setSearchEffort(int ef_search);
+
+    string getPartitionColumn() { return m_partColumn; }
+
+    AbstractVectorIndex* getPartition(const string & value, bool create = false);
+
+    bool insertVectorPartition(VectorPtr vec, int dim, KeyTypeInteger id,
+                               KeyTypeInteger docid, const string & value);
+
+private:
+    string partitionIndexName(size_t ordinal)
+        { return m_name + ".p" + to_string(ordinal); }
+    string catalogFileName(const string & path)
+        { return path + "/" + m_name + ".hnsw.partitions"; }
+
+    bool readCatalog(const string & path, vector<string> & values);
+    template<class SearchFn>
+    void searchAllPartitions(vector<KeyTypeInteger> & keys, int n, SearchFn search);
+    bool writeCatalog(const string & path);
+    void clearPartitions();
+
+    string          m_name;
+    string          m_type;
+    string          m_options;
+    string          m_partOptions; /// options for each partition index
+    MyVectorOptions m_optionsMap;
+    unsigned long   m_updateTs;
+
+    int             m_dim;
+    string          m_partColumn;
+
+    bool            m_isDirty{false};
+    bool            m_incrUpdates;
+    bool            m_incrRefresh;
+
+    bool            m_isParallelBuild{false};
+    int             m_threads{0};
+    int             m_ef_search{0};
+
+    unsigned long   m_buildRows{0}; /// last build
+    double          m_buildSecs{0};
+
+    /// last update coordinates, shared by all partitions
+    string          m_binlogFile;
+    size_t          m_binlogPosition{0};
+
+    /* value -> partition index. m_partValues[N] is the value of partition N */
+    shared_mutex                            m_partMutex;
+    size_t                                  m_nSaved{0}; /// partitions on disk
+    unordered_map<string, HNSWMemoryIndex*> m_partitions;
+    vector<string>                          m_partValues;
+
+    /* key -> partition holding the key */
+    mutex                                           m_keyMutex;
+    unordered_map<KeyTypeInteger, HNSWMemoryIndex*> m_keyPartitions;
+};
+
+HNSWPartitionedIndex::HNSWPartitionedIndex(const string & name, const string & options)
+  : m_name(name), m_options(options), m_optionsMap(options), m_updateTs(0)
+{
+  m_dim         = atoi(m_optionsMap.getOption("dim").c_str());
+  m_type        = m_optionsMap.getOption("type");
+  m_partColumn  = m_optionsMap.getOption("partition_by");
+  m_incrUpdates = m_optionsMap.getOption("online") == "Y";
+  m_incrRefresh = m_optionsMap.getOption("track").length() > 0;
+
+  /* Options are parsed left to right, so an appended size= overrides the
+   * size of the whole index for the partition indexes.
+   */
+  m_partOptions = m_options;
+  if (m_optionsMap.getOption("psize").length())
+    m_partOptions += ",size=" + m_optionsMap.getOption("psize");
+
+  setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
+
+  debug_print("hnsw partitioned index %s partition_by=%s", name.c_str(),
+              m_partColumn.c_str());
+}
+
+HNSWPartitionedIndex::~HNSWPartitionedIndex()
+{
+  clearPartitions();
+}
+
+void HNSWPartitionedIndex::clearPartitions()
+{
+  unique_lock<shared_mutex> l(m_partMutex);
+  for (auto & part : m_partitions)
+    delete part.second;
+  m_partitions.clear();
+  m_partValues.clear();
+  m_nSaved = 0;
+
+  lock_guard<mutex> lk(m_keyMutex);
+  m_keyPartitions.clear();
+}
+
+bool HNSWPartitionedIndex::initIndex()
+{
+  clearPartitions();
+
+  m_isDirty = false;
+  setLastUpdateCoordinates("zzzzzz.bin", 99999999999);
+  setUpdateTs(0);
+  return true;
+}
+
+AbstractVectorIndex* HNSWPartitionedIndex::getPartition(const string & value, bool create)
+{
+  {
+    shared_lock<shared_mutex> l(m_partMutex);
+    auto it = m_partitions.find(value);
+    if (it != m_partitions.end())
+      return it->second;
+  }
+  if (!create)
+    return nullptr;
+
+  unique_lock<shared_mutex> l(m_partMutex);
+  auto it = m_partitions.find(value); /// another thread could have added it
+  if (it != m_partitions.end())
+    return it->second;
+
+  HNSWMemoryIndex *part = new HNSWMemoryIndex(partitionIndexName(m_partValues.size()),
+                                              m_partOptions);
+  part->initIndex();
+  part->setLastUpdateCoordinates(m_binlogFile, m_binlogPosition);
+  if (m_ef_search)       part->setSearchEffort(m_ef_search);
+  if (m_isParallelBuild) part->startParallelBuild(m_threads);
+
+  m_partitions[value] = part;
+  m_partValues.push_back(value);
+  m_isDirty = true;
+
+  return part;
+}
+
+/* insertVectorPartition - the partition of a key is looked up in
+ * m_keyPartitions. If the partition value of the row changed, the key is
+ * deleted from the old partition before the insert into the new one.
+ */
+bool HNSWPartitionedIndex::insertVectorPartition(VectorPtr vec, int dim, KeyTypeInteger id,
+                                                 KeyTypeInteger docid, const string & value)
+{
+  HNSWMemoryIndex *part = static_cast<HNSWMemoryIndex *>(getPartition(value, true));
+  HNSWMemoryIndex *old  = nullptr;
+  {
+    lock_guard<mutex> l(m_keyMutex);
+    auto it = m_keyPartitions.find(id);
+    if (it == m_keyPartitions.end())
+      m_keyPartitions.emplace(id, part);
+    else if (it->second != part) {
+      old        = it->second;
+      it->second = part;
+    }
+  }
+  if (old)
+    old->deleteVector(id);
+
+  if (getDocIdColumn().length())
+    return part->insertVectorDoc(vec, dim, id, docid);
+  return part->insertVector(vec, dim, id);
+}
+
+/* insertVector - rows of a partitioned index have to be routed through
+ * insertVectorPartition() by the caller, there is no "default" partition.
+ */
+bool HNSWPartitionedIndex::insertVector(VectorPtr /*vec*/, int /*dim*/, KeyTypeInteger id)
+{
+  error_print("Partitioned index %s : insert of %lu without partition value.",
+              m_name.c_str(), id);
+  return false;
+}
+
+/* insertVectorDoc - as insertVector(), the doc id is passed along with the
+ * partition value to insertVectorPartition().
+ */
+bool HNSWPartitionedIndex::insertVectorDoc(VectorPtr /*vec*/, int /*dim*/, KeyTypeInteger id,
+                                           KeyTypeInteger docid)
+{
+  error_print("Partitioned index %s : insert of %lu (doc %lu) without partition value.",
+              m_name.c_str(), id, docid);
+  return false;
+}
+
+/* searchAllPartitions - run 'search' on every partition and return the
+ * nearest 'n' across all of them.
+ */
+template<class SearchFn>
+void HNSWPartitionedIndex::searchAllPartitions(vector<KeyTypeInteger> & keys, int n,
+                                               SearchFn search)
+{
+  vector<pair<double, KeyTypeInteger>> merged;
+  vector<KeyTypeInteger>               partkeys;
+
+  {
+    shared_lock<shared_mutex> l(m_partMutex);
+    for (auto & part : m_partitions) {
+      search(part.second, partkeys);
+      for (auto key : partkeys)
+        merged.push_back({(*tls_distances)[key], key});
+    }
+  }
+
+  sort(merged.begin(), merged.end());
+
+  keys.clear();
+  tls_distances->clear();
+  for (auto & m : merged) {
+    if (keys.size() == (size_t)n)
+      break;
+    if (tls_distances->count(m.second)) /// key moved partitions during the search
+      continue;
+    keys.push_back(m.second);
+    (*tls_distances)[m.second] = m.first;
+  }
+}
+
+/* searchVectorNN - search without a partition value. Every partition is
+ * searched and the nearest 'n' across all of them are returned.
+ */
+bool HNSWPartitionedIndex::searchVectorNN(VectorPtr qvec, int dim,
+                                          vector<KeyTypeInteger> & keys, int n,
+                                          const VectorSearchParams & params)
+{
+  searchAllPartitions(keys, n, [&](HNSWMemoryIndex *part, vector<KeyTypeInteger> & pkeys) {
+    part->searchVectorNN(qvec, dim, pkeys, n, params);
+  });
+  return true;
+}
+
+bool HNSWPartitionedIndex::searchVectorRange(VectorPtr qvec, int dim,
+                                             vector<KeyTypeInteger> & keys,
+                                             double radius, int maxn,
+                                             const VectorSearchParams & params)
+{
+  searchAllPartitions(keys, maxn, [&](HNSWMemoryIndex *part, vector<KeyTypeInteger> & pkeys) {
+    part->searchVectorRange(qvec, dim, pkeys, radius, maxn, params);
+  });
+  return true;
+}
+
+bool HNSWPartitionedIndex::searchVectorDocs(VectorPtr qvec, int dim,
+                                            vector<KeyTypeInteger> & docids, int ndocs,
+                                            const VectorSearchParams & params)
+{
+  if (!getDocIdColumn().length())
+    return false;
+
+  searchAllPartitions(docids, ndocs, [&](HNSWMemoryIndex *part, vector<KeyTypeInteger> & pdocs) {
+    part->searchVectorDocs(qvec, dim, pdocs, ndocs, params);
+  });
+  return true;
+}
+
+unsigned long HNSWPartitionedIndex::getRowCount()
+{
+  shared_lock<shared_mutex> l(m_partMutex);
+  unsigned long rows = 0;
+  for (auto & part : m_partitions)
+    rows += part.second->getRowCount();
+  return rows;
+}
+
+bool HNSWPartitionedIndex::startParallelBuild(int nthreads)
+{
+  shared_lock<shared_mutex> l(m_partMutex);
+  m_isParallelBuild = true;
+  m_threads         = nthreads;
+  for (auto & part : m_partitions)
+    part.second->startParallelBuild(nthreads);
+  return true;
+}
+
+void HNSWPartitionedIndex::setSearchEffort(int ef_search)
+{
+  shared_lock<shared_mutex> l(m_partMutex);
+  m_ef_search = ef_search;
+  for (auto & part : m_partitions)
+    part.second->setSearchEffort(ef_search);
+}
+
+void HNSWPartitionedIndex::getLastUpdateCoordinates(string &binlogFile,
+                                                    size_t &binlogPosition) {
+  binlogFile     = m_binlogFile;
+  binlogPosition = m_binlogPosition;
+}
+
+void HNSWPartitionedIndex::setLastUpdateCoordinates(const string &binlogFile,
+                                                    const size_t &binlogPosition) {
+  m_binlogFile     = binlogFile;
+  m_binlogPosition = binlogPosition;
+}
+
+/* Catalog file format : one line per partition, in partition number order,
+ * <length of value> <value>
+ */
+bool HNSWPartitionedIndex::readCatalog(const string & path, vector<string> & values)
+{
+  ifstream catalog(catalogFileName(path), ios::binary);
+  values.clear();
+  if (!catalog.is_open())
+    return false;
+
+  size_t len = 0;
+  while (catalog >> len) {
+    string value(len, '\0');
+    catalog.get(); /// separator
+    catalog.read(&value[0], len);
+    values.push_back(value);
+  }
+  return true;
+}
+
+bool HNSWPartitionedIndex::writeCatalog(const string & path)
+{
+  string filename = catalogFileName(path);
+  string tmpname  = filename + ".tmp";
+
+  ofstream catalog(tmpname, ios::binary | ios::trunc);
+  if (!catalog.is_open()) {
+    error_print("Partitioned index %s : cannot write %s.", m_name.c_str(),
+                tmpname.c_str());
+    return false;
+  }
+  for (auto & value : m_partValues)
+    catalog << value.length() << " " << value << "\n";
+  catalog.close();
+
+  return (rename(tmpname.c_str(), filename.c_str()) == 0);
+}
+
+bool HNSWPartitionedIndex::saveIndex(const string & path, const string & option)
+{
+  shared_lock<shared_mutex> l(m_partMutex);
+
+  debug_print("HNSWPartitionedIndex::saveIndex %s %s, %lu partitions.",
+              m_name.c_str(), option.c_str(), m_partValues.size());
+
+  for (size_t i = 0; i < m_partValues.size(); i++) {
+    HNSWMemoryIndex *part = m_partitions[m_partValues[i]];
+    part->setUpdateTs(m_updateTs);
+    part->setLastUpdateCoordinates(m_binlogFile, m_binlogPosition);
+    /* A partition added since the last save has no files to checkpoint into,
+     * it is reordered only by the save of the build.
+     */
+    part->saveIndex(path, (i >= m_nSaved && option != "build_reorder" ? "build" : option));
+  }
+
+  writeCatalog(path);
+  m_nSaved = m_partValues.size();
+
+  m_isDirty         = false;
+  m_isParallelBuild = false;
+  return true;
+}
+
+bool HNSWPartitionedIndex::loadIndex(const string & path)
+{
+  vector<string> values;
+
+  initIndex();
+
+  if (!readCatalog(path, values)) { /* no disk files found */
+    warning_print("Partitioned index %s : no partitions found in %s.",
+                  m_name.c_str(), path.c_str());
+    return true;
+  }
+
+  unique_lock<shared_mutex> l(m_partMutex);
+  for (size_t i = 0; i < values.size(); i++) {
+    HNSWMemoryIndex *part = new HNSWMemoryIndex(partitionIndexName(i), m_partOptions);
+    part->loadIndex(path);
+    m_partitions[values[i]] = part;
+    m_partValues.push_back(values[i]);
+  }
+  m_nSaved = m_partValues.size();
+
+  {
+    lock_guard<mutex> lk(m_keyMutex);
+    vector<KeyTypeInteger> keys;
+    for (auto & part : m_partitions) {
+      keys.clear();
+      part.second->getKeys(keys);
+      for (auto key : keys)
+        m_keyPartitions[key] = part.second;
+    }
+  }
+
+  /* Partitions are always checkpointed together */
+  if (m_partValues.size()) {
+    HNSWMemoryIndex *part = m_partitions[m_partValues[0]];
+    part->getLastUpdateCoordinates(m_binlogFile, m_binlogPosition);
+    setUpdateTs(part->getUpdateTs());
+  }
+
+  info_print("Partitioned index %s : loaded %lu partitions.", m_name.c_str(),
+             m_partValues.size());
+  return true;
+}
+
+bool HNSWPartitionedIndex::dropIndex(const string & path)
+{
+  vector<string> values;
+  readCatalog(path, values);
+
+  {
+    shared_lock<shared_mutex> l(m_partMutex);
+    if (m_partValues.size() > values.size())
+      values = m_partValues;
+  }
+
+  /* Partitions on disk need not be loaded, drop them by name */
+  for (size_t i = 0; i < values.size(); i++) {
+    HNSWMemoryIndex part(partitionIndexName(i), m_partOptions);
+    part.dropIndex(path);
+  }
+  unlink(catalogFileName(path).c_str());
+
+  return true;
+}
+
+string HNSWPartitionedIndex::getStatus()
+{
+  std::stringstream ss;
+
+  ss << endl;
+  ss << "Vector Index : " << m_name << endl;
+  ss << "Type : " << m_type << endl;
+  ss << "Dimension : " << m_dim << endl;
+  ss << "Distance : " << m_optionsMap.getOption("dist") << endl;
+  ss << "Partition Column : " << m_partColumn << endl;
+  if (m_buildSecs > 0)
+    ss << "Last Build : " << m_buildRows << " rows in " << m_buildSecs << " secs ("
+       << (unsigned long)(m_buildRows / m_buildSecs) << " rows/sec)" << endl;
+
+  shared_lock<shared_mutex> l(m_partMutex);
+  ss << "Partitions : " << m_partValues.size() << endl;
+  for (size_t i = 0; i < m_partValues.size(); i++) {
+    ss << "Partition " << i << " (" << m_partValues[i] << ") Rows : "
+       << m_partitions[m_partValues[i]]->getRowCount() << endl;
+  }
+
+  return ss.str();
+}
+
+
+VectorIndexHandle VectorIndexCollection::create(const string &name,
+                const string &options) {
+  AbstractVectorIndex *hnewindex = nullptr;
+
+  /* First case handles both HNSW and HNSW_BV */
+  if (options.rfind("type=HNSW") != string::npos &&
+      MyVectorOptions(options).getOption("partition_by").length()) {
+    hnewindex = new HNSWPartitionedIndex(name, options);
+  }
+  else if (options.rfind("type=HNSW") != string::npos) {
+    hnewindex = new HNSWMemoryIndex(name, options);
+  }
+  else if (options.rfind("type=KNN") != string::npos) {
+    hnewindex = new KNNIndex(name, options);
+  }
+  else {
+    my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+      "MyVector unknown index type for %s options = %s, using KNN",
+      name.c_str(), options.c_str());
+    hnewindex = new KNNIndex(name, options);
+  }
+
+  /* runs when the last query/update holding the index is done */
+  return VectorIndexHandle(hnewindex, [](AbstractVectorIndex *hindex) {
+    hindex->closeIndex();
+    delete hindex;
+  });
+}
+
+VectorIndexHandle VectorIndexCollection::open(const string &name,
+                const string &options, const string &useraction) {
+
+  lock_guard<mutex> l(m_mutex); // exclusive
+
+  debug_print("Opening new index %s %s %s", name.c_str(), options.c_str(), useraction.c_str());
+
+  VectorIndexHandle hnewindex = create(name, options);
+
+  m_indexes[name] = hnewindex;
+
+  return hnewindex;
+}
+
+VectorIndexHandle VectorIndexCollection::get(const string &name)
+{
+  lock_guard<mutex> l(m_mutex);
+  auto it = m_indexes.find(name);
+  if (it != m_indexes.end())
+    return it->second;
+
+  my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+    "VectorIndexCollection::get() index not found %s", name.c_str());
+  return nullptr;
+}
+
+bool VectorIndexCollection::replace(const VectorIndexHandle &hold,
+                                    const VectorIndexHandle &hnew)
+{
+  lock_guard<mutex> l(m_mutex);
+
+  auto it = m_indexes.find(hold->getName());
+  if (it == m_indexes.end() || it->second != hold)
+    return false; /* dropped while hnew was built */
+
+  it->second = hnew; /* new queries get hnew, running ones keep hold */
+  return true;
+}
+
+bool VectorIndexCollection::close(const VectorIndexHandle &hindex)
+{
+  lock_guard<mutex> l(m_mutex);
+
+  auto it = m_indexes.find(hindex->getName());
+  if (it == m_indexes.end() || it->second != hindex)
+    return false; /* replaced or closed by another thread */
+
+  m_indexes.erase(it);
+  return true;
+}
+
+/* FindEarliestBinlogFile() - Find the oldest binlog file from all
+ * the "online" vector indexes checkpoint info.
+ */
+string VectorIndexCollection::FindEarliestBinlogFile() {
+  lock_guard<mutex> l(m_mutex);
+  string ret = "";
+  for (auto entry : m_indexes) {
+    string binlogfile;
+    size_t binlogpos;
+    if (entry.second->supportsIncrUpdates()) {
+      entry.second->getLastUpdateCoordinates(binlogfile, binlogpos);
+      if (ret == "") 
+        ret = binlogfile;
+      else if (binlogfile < ret)
+        ret = binlogfile;
+    }
+  }
+  if (ret == "zzzzzz.bin")
+    ret = "";
+  debug_print("FindEarliestBinlogFile : %s.", ret.c_str());
+  return ret;
+}
+
+static VectorIndexCollection g_indexes;
 
 /* The MYVECTOR* Annotations supported by this plugin */
 const string MYVECTOR_COLUMN_A = "MYVECTOR(";
@@ -1192,9 +2608,9 @@ const string MYVECTOR_SEARCH_USAGE = "MYVECTOR_SEARCH(baseTable,idColumn,vectorC
 
 
 /* MySQL Column COMMENT max. length is 1024.e.g comment with all fields set :
- * MYVECTOR Column |type=HNSW,dim=1536,size=1000000,M=64,ef=100,track=updatets,threads=8,dist=L2
+ * MYVECTOR Column |type=HNSW,dim=1536,size=1000000,M=64,ef=100,track=updatets,threads=8,dist=L2,partition_by=tenant_id,psize=100000
  */
-const size_t MYVECTOR_MAX_COLUMN_INFO_LEN = 128;
+const size_t MYVECTOR_MAX_COLUMN_INFO_LEN = 256;
 
 /* For v1, let us restrict to 4096. OpenAI has 3072 dimension embeddings
  * now in model :  text-embedding-3-large. Technically, there is no limitation
@@ -1202,6 +2618,40 @@ const size_t MYVECTOR_MAX_COLUMN_INFO_LEN = 128;
  */
 const size_t MYVECTOR_MAX_VECTOR_DIM      = 4096;
 
+/* isDocIdColumnDefInvalid() - true if the docid=<col> column is defined in
+ * the same statement with a non-integer type. A column defined elsewhere is
+ * checked by the build, from information_schema.
+ */
+static bool isDocIdColumnDefInvalid(const string & query, const string & docid)
+{
+    static const set<string> intTypes = {"tinyint", "smallint", "mediumint",
+                                         "int", "integer", "bigint", "bool",
+                                         "boolean"};
+    static const set<string> otherTypes = {"char", "varchar", "binary", "varbinary",
+                                           "text", "tinytext", "mediumtext", "longtext",
+                                           "blob", "tinyblob", "mediumblob", "longblob",
+                                           "decimal", "numeric", "float", "double",
+                                           "real", "bit", "date", "datetime", "time",
+                                           "timestamp", "year", "json", "enum", "set",
+                                           "vector", "geometry", "point"};
+
+    if (docid.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_$") != string::npos)
+        return false;
+
+    regex coldef("(^|[(,\\s])`?" + docid + "`?\\s+([A-Za-z]+)", regex::icase);
+    for (sregex_iterator it(query.begin(), query.end(), coldef), end; it != end; ++it)
+    {
+        string type = (*it)[2].str();
+        transform(type.begin(), type.end(), type.begin(), ::tolower);
+        if (intTypes.count(type))
+            return false;
+        if (otherTypes.count(type))
+            return true;
+    }
+    return false;
+}
+
 /* rewriteMyVectorColumnDef() - rewrite the MYVECTOR(...) annotation in
  * CREATE TABLE & ALTER TABLE.
  */
@@ -1260,6 +2710,78 @@ bool rewriteMyVectorColumnDef(const string & query, string & newQuery)
             break;
         }
 
+        if (vo.getOption("partition_by").length() && vtype == "KNN")
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR partition_by is supported only for HNSW indexes.");
+            error = true;
+            break;
+        }
+
+        if (vo.getOption("docid").length() &&
+            (vtype != "HNSW" || (vo.getOption("dist").length() &&
+                                 vo.getOption("dist") != "L2" &&
+                                 vo.getOption("dist") != "CosineNorm")))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR docid is supported only for HNSW indexes with dist=L2 or CosineNorm.");
+            error = true;
+            break;
+        }
+
+        if (vo.getOption("docid").length() &&
+            isDocIdColumnDefInvalid(query, vo.getOption("docid")))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR docid column %s has to be an integer column.",
+                                  vo.getOption("docid").c_str());
+            error = true;
+            break;
+        }
+
+        if (vo.getOption("reorder").length() &&
+            (vtype == "KNN" || vo.getOption("reorder") != "bfs"))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR reorder=bfs is the only reorder option, for HNSW indexes.");
+            error = true;
+            break;
+        }
+
+        if (vo.getOption("layout").length() &&
+            (vtype == "KNN" || (vo.getOption("layout") != "split" &&
+                                vo.getOption("layout") != "interleaved")))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR layout=split|interleaved is supported only for HNSW indexes.");
+            error = true;
+            break;
+        }
+
+        if (vo.getOption("build").length() &&
+            (vo.getOption("build") != "lock" &&
+             (vo.getOption("build") != "snapshot" || vo.getOption("online") != "Y")))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL,
+                                  "MYVECTOR build=lock|snapshot, build=snapshot needs online=Y.");
+            error = true;
+            break;
+        }
+
+        hnswlib::IndexMemory::NumaPolicy numa;
+        int numaNode;
+        if ((vo.getOption("hugepages").length() || vo.getOption("numa").length()) &&
+            (vtype == "KNN" ||
+             (vo.getOption("hugepages").length() && vo.getOption("hugepages") != "Y" &&
+              vo.getOption("hugepages") != "1G") ||
+             !hnswlib::IndexMemory::parseNumaOption(vo.getOption("numa"), numa, numaNode)))
+        {
+            my_plugin_log_message(&gplugin, MY_ERROR_LEVEL, 
+                                  "MYVECTOR hugepages=Y|1G and numa=interleave|node:N are supported only for HNSW indexes.");
+            error = true;
+            break;
+        }
+
         bool addTrackingColumn = false;
         string trackingColumn;
         if (vo.getOption("track").length())
@@ -1482,44 +3004,197 @@ bool myvector_query_rewrite(const string & query, string * rewritten_query)
     else if ((regex_search(query, create_table) || regex_search(query, alter_table))
               && (strstr(query.c_str(), MYVECTOR_COLUMN_A.c_str())))
     {
-        if (rewriteMyVectorColumnDef(query, newQuery))
-        {
-            newQuery = "";
-        }
+        if (rewriteMyVectorColumnDef(query, newQuery))
+        {
+            newQuery = "";
+        }
+    }
+
+    if (newQuery.length())
+        *rewritten_query = newQuery;
+
+    return (*rewritten_query != query);
+}
+
+/* Result formats of myvector_ann_set(), option format=json|csv|binary */
+enum class AnnResultFormat { JSON, CSV, BINARY };
+
+static AnnResultFormat getAnnResultFormat(const string & format)
+{
+    if (format == "csv")    return AnnResultFormat::CSV;
+    if (format == "binary") return AnnResultFormat::BINARY;
+    return AnnResultFormat::JSON;
+}
+
+/* formatAnnResult - write the result ids straight into the UDF buffer.
+ *   json   : [1,2,3] - default, parsed by JSON_TABLE in the MYVECTOR_IS_ANN
+ *            rewrite.
+ *   csv    : 1,2,3 - no JSON parse e.g FIND_IN_SET() or split in the client.
+ *   binary : packed 8-byte little endian ids, nothing to parse at all.
+ * Returns the length of the result.
+ */
+static size_t formatAnnResult(const vector<KeyTypeInteger> & keys,
+                              AnnResultFormat format, char *buf, size_t buflen)
+{
+    char *p   = buf;
+    char *end = buf + buflen;
+
+    if (format == AnnResultFormat::BINARY)
+    {
+        size_t n = min(keys.size(), buflen / sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t id = keys[i];
+            for (size_t b = 0; b < sizeof(uint64_t); b++)
+                *p++ = (char)((id >> (b * BITS_PER_BYTE)) & 0xff);
+        }
+        return (p - buf);
+    }
+
+    if (format == AnnResultFormat::JSON) *p++ = '[';
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if ((end - p) < 22) break; /// buffer is sized for max. nn, just in case
+        if (i) *p++ = ',';
+        p = to_chars(p, end, keys[i]).ptr;
+    }
+    if (format == AnnResultFormat::JSON) *p++ = ']';
+
+    return (p - buf);
+}
+
+/* AnnSearchOptions - parsed search options of myvector_ann_set() */
+struct AnnSearchOptions
+{
+    int             nn{MYVECTOR_DEFAULT_ANN_RETURN_COUNT};
+    int             ef_search{0};
+    double          target_recall{0}; /// > 0 : adaptive early termination
+    double          radius{-1}; /// < 0 : nn search, else range search
+    int             ndocs{0};   /// > 0 : multi-vector search, return doc ids
+    AnnResultFormat format{AnnResultFormat::JSON};
+    bool            hasPartition{false};
+    string          partition;
+
+    void parse(const char *options, unsigned long length);
+};
+
+void AnnSearchOptions::parse(const char *options, unsigned long length)
+{
+    MyVectorOptions vo(string(options, length));
+    string          nstr = vo.getOption("nn"); /* How many neighbours to return? */
+
+    if (nstr.length()) nn = atoi(nstr.c_str());
+    if (nn <= 0)       nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+    
+    nn = min((const unsigned int)nn, MYVECTOR_MAX_ANN_RETURN_COUNT);
+
+    string ef_search_str = vo.getOption("ef_search");
+    if (ef_search_str.length())
+    {
+        ef_search = atoi(ef_search_str.c_str());
+    }
+
+    /* target_recall=<r> - stop early once the neighbours converge, the stop
+     * threshold is calibrated per index for the recall target and ef.
+     */
+    string target_recall_str = vo.getOption("target_recall");
+    if (target_recall_str.length())
+    {
+        target_recall = atof(target_recall_str.c_str());
+        if (target_recall < 0) target_recall = 0;
+        if (target_recall > 1) target_recall = 1;
+    }
+
+    /* radius=<d>[,max=<n>] - all neighbours within distance d, nearest first */
+    string radius_str = vo.getOption("radius");
+    if (radius_str.length())
+    {
+        radius = atof(radius_str.c_str());
+        if (radius < 0) radius = 0;
+
+        string max_str = vo.getOption("max");
+        nn = (max_str.length() ? atoi(max_str.c_str()) : MYVECTOR_MAX_ANN_RETURN_COUNT);
+        if (nn <= 0) nn = MYVECTOR_MAX_ANN_RETURN_COUNT;
+        nn = min((const unsigned int)nn, MYVECTOR_MAX_ANN_RETURN_COUNT);
     }
 
-    if (newQuery.length())
-        *rewritten_query = newQuery;
+    format = getAnnResultFormat(vo.getOption("format"));
 
-    return (*rewritten_query != query);
+    /* ndocs=<K> - K nearest documents of a docid=<col> index */
+    string ndocs_str = vo.getOption("ndocs");
+    if (ndocs_str.length())
+    {
+        ndocs = atoi(ndocs_str.c_str());
+        if (ndocs <= 0) ndocs = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
+        ndocs = min((const unsigned int)ndocs, MYVECTOR_MAX_ANN_RETURN_COUNT);
+    }
+
+    /* partition=<value> - search only the sub-index of a partition_by index */
+    partition    = vo.getOption("partition");
+    hasPartition = partition.length() > 0;
 }
 
+/* AnnSetState - myvector_ann_set() state in initid->ptr. Constant arguments
+ * are resolved once in _init() - the index handle (held till _deinit() so
+ * that the index is not freed under the query) and the search options. Only
+ * the query vector is read for each row.
+ */
+struct AnnSetState
+{
+    VectorIndexHandle    vi;               /// nullptr : index name not a constant
+    bool                 constOptions{false};
+    AnnSearchOptions     options;
+    vector<char>         buffer;           /// result
+};
+
 PLUGIN_EXPORT bool myvector_ann_set_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
 {
     initid->ptr = nullptr;
     if (args->arg_count < 3 || args->arg_count > 4)
     {
         strcpy(message, "Incorrect arguments, usage : "
-               "myvector_ann_set('vec column', 'id column', searchvec [,nn=<n>]).");
+               "myvector_ann_set('vec column', 'id column', searchvec "
+               "[,'nn=<n>' | 'radius=<d>,max=<n>' | 'ndocs=<n>']).");
         return true; // error
     }
 
     char *col                 = args->args[0];
-    AbstractVectorIndex *vi = g_indexes.get(col);
-    SharedLockGuard l(vi);
-    if (!vi)
+    VectorIndexHandle vi;
+    if (col) /// constant, hold the index till _deinit()
     {
-        sprintf(message, "Vector index (%s) not defined or not open for access.",
-                col);
-        return true; // error
+        vi = g_indexes.get(string(col, args->lengths[0]));
+        if (!vi)
+        {
+            snprintf(message, MYSQL_ERRMSG_SIZE,
+                     "Vector index (%.*s) not defined or not open for access.",
+                     (int)args->lengths[0], col);
+            return true; // error
+        }
+    }
+
+    AnnSetState *state = new AnnSetState();
+    state->vi          = vi;
+
+    if (args->arg_count == 4 && args->args[3]) /// constant options
+    {
+        state->constOptions = true;
+        state->options.parse(args->args[3], args->lengths[3]);
     }
 
-    /* Users can possibly ask for 100s of neighbours. With buffer of 128000,
-     * about 12800 PK ids can be filled in the return string
+    /* Users can possibly ask for 1000s of neighbours, buffer can hold the
+     * maximum allowed i.e MYVECTOR_MAX_ANN_RETURN_COUNT ids.
+     */
+    initid->max_length = MYVECTOR_ANN_SET_MAX_LEN;
+    state->buffer.resize(initid->max_length);
+    initid->ptr        = (char *)state;
+
+    /* format=binary needs a binary result, it is known only if the
+     * options are a constant.
      */
-    initid->max_length = MYVECTOR_DISPLAY_MAX_LEN;
-    initid->ptr        = (char *)malloc(initid->max_length);
-    (*h_udf_metadata_service)->result_set(initid, "charset", latin1);
+    bool binaryResult = (state->constOptions &&
+                         state->options.format == AnnResultFormat::BINARY);
+    (*h_udf_metadata_service)->result_set(initid, "charset",
+                                          (binaryResult ? binary : latin1));
 
     if (!tls_distances)
         tls_distances = new unordered_map<KeyTypeInteger, double>();
@@ -1530,7 +3205,11 @@ PLUGIN_EXPORT bool myvector_ann_set_init(UDF_INIT *initid, UDF_ARGS *args, char
 PLUGIN_EXPORT void myvector_ann_set_deinit(UDF_INIT * initid)
 {
     if (initid && initid->ptr)
-        free(initid->ptr);
+    {
+        AnnSetState *state = (AnnSetState *)initid->ptr;
+        delete state; /* releases the index handle */
+        initid->ptr = nullptr;
+    }
     if (tls_distances)
         delete tls_distances;
     tls_distances = nullptr;
@@ -1540,63 +3219,84 @@ PLUGIN_EXPORT char* myvector_ann_set(UDF_INIT * initid, UDF_ARGS * args, char *
                           unsigned long * length, unsigned char * is_null,
                           unsigned char * error)
 {
+  AnnSetState *state        = (AnnSetState *)initid->ptr;
   char *col                 = args->args[0];
   char *idcol               = args->args[1];
   FP32 *searchvec           = (FP32 *)args->args[2];
   const char *searchoptions = nullptr;
+
+  static const char nullResult[] = "[NULL]";
+  result = state->buffer.data();
   
   if (!col || !idcol || !searchvec) {
     *error = 1;
     *is_null = 1;
-    return initid->ptr;
+    *length  = 0;
+    return result;
   }
   
   if (args->arg_count == 4) searchoptions = args->args[3];
 
-  int nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
-  int ef_search = 0;
-  if (searchoptions && args->lengths[3]) {
-    MyVectorOptions vo(searchoptions);
-    string          nstr = vo.getOption("nn"); /* How many neighbours to return? */
-
-    if (nstr.length()) nn = atoi(nstr.c_str());
-    if (nn <= 0)       nn = MYVECTOR_DEFAULT_ANN_RETURN_COUNT;
-    
-    nn = min((const unsigned int)nn, MYVECTOR_MAX_ANN_RETURN_COUNT);
-
-    string ef_search_str = vo.getOption("ef_search");
-    if (ef_search_str.length())
-    {
-        ef_search = atoi(ef_search_str.c_str());
+  /* Options that are not a constant are parsed for each row */
+  AnnSearchOptions rowOptions;
+  if (!state->constOptions && searchoptions && args->lengths[3])
+    rowOptions.parse(searchoptions, args->lengths[3]);
+  const AnnSearchOptions & opts = (state->constOptions ? state->options : rowOptions);
+ 
+  VectorIndexHandle rowvi;
+  if (!state->vi) /// index name is not a constant
+    rowvi = g_indexes.get(string(col, args->lengths[0]));
+  AbstractVectorIndex *vi = (state->vi ? state->vi.get() : rowvi.get());
+
+  AbstractVectorIndex *si = vi;
+  if (vi && opts.hasPartition) {
+    if (!vi->getPartitionColumn().length()) {
+      my_plugin_log_message(&gplugin, MY_ERROR_LEVEL,
+        "myvector_ann_set : index %s is not partitioned, partition=%s not allowed.",
+        vi->getName().c_str(), opts.partition.c_str());
+      si = nullptr;
     }
+    else
+      si = vi->getPartition(opts.partition); /// nullptr if value has no rows
   }
- 
-  AbstractVectorIndex *vi = g_indexes.get(col);
-  SharedLockGuard l(vi);
   
-  stringstream ss;
-  if (vi && searchvec) {
-    vector<KeyTypeInteger> result;
-    if (ef_search) vi->setSearchEffort(ef_search);
-    vi->searchVectorNN(searchvec, vi->getDimension(), result, nn);
-
-    /* simple JSON list of neighbour rows Pkid */
-    ss <<  "[";
-    for (int i = 0; i < result.size(); i++) {
-      if (i) ss << ",";
-      ss << result[i];
-    } 
-    ss << "]";
+  vector<KeyTypeInteger> keys;
+
+  if (vi && opts.hasPartition && si == nullptr && vi->getPartitionColumn().length()) {
+    /// no rows with this partition value, empty result
+    *length = formatAnnResult(keys, opts.format, result, state->buffer.size());
+  }
+  else if (si) {
+    bool ret = true;
+    VectorSearchParams params;
+    params.ef_search     = opts.ef_search; /// this query only, index is not changed
+    params.target_recall = opts.target_recall;
+    if (opts.ndocs)
+      ret = si->searchVectorDocs(searchvec, si->getDimension(), keys, opts.ndocs, params);
+    else if (opts.radius >= 0)
+      ret = si->searchVectorRange(searchvec, si->getDimension(), keys, opts.radius,
+                                  opts.nn, params);
+    else
+      si->searchVectorNN(searchvec, si->getDimension(), keys, opts.nn, params);
+
+    if (!ret) {
+      my_plugin_log_message(&gplugin, MY_ERROR_LEVEL,
+        "myvector_ann_set : search options not supported by index %s.",
+        vi->getName().c_str());
+      *is_null = 1;
+      *error   = 1;
+    }
+
+    /* list of neighbour rows Pkid (doc ids if ndocs=) */
+    *length = formatAnnResult(keys, opts.format, result, state->buffer.size());
   }
   else {
     *is_null = 1;
     *error   = 1;
-    ss << "[NULL]";
+    *length  = sizeof(nullResult) - 1;
+    memcpy(result, nullResult, *length);
   }
 
-  *length = ss.str().length();
-  result = initid->ptr;
-  strcpy(result, ss.str().c_str());
   return result;
 }
 
@@ -1680,11 +3380,11 @@ char *myvector_construct_bv(const std::string &srctype, char *src, char *dst,
 
 
 #if MYSQL_VERSION_ID < 90000
-  unsigned int metadata = MYVECTOR_V1_BV_METADATA;
+  unsigned int metadata = MYVECTOR_V2_BV_METADATA;
   memcpy(&dst[retlen], &metadata, sizeof(metadata));
   retlen += sizeof(metadata);
  
-  ha_checksum cksum = my_checksum(0, (const unsigned char *)dst, retlen);
+  ha_checksum cksum = MyVectorChecksum((const unsigned char *)dst, retlen);
   memcpy(&dst[retlen], &cksum, sizeof(cksum));
   retlen += sizeof(cksum);
 #endif
@@ -1693,6 +3393,258 @@ char *myvector_construct_bv(const std::string &srctype, char *src, char *dst,
 }
 
 
+/* Characters between the values of an embedding string */
+static inline bool MyVectorIsSeparator(char c) {
+  return (c == ' ' || c == ',' || c == '\t' || c == '\n' || c == '\r');
+}
+
+/* MyVectorStrToF - strtof() of the value at [p, end), for values that
+ * from_chars() cannot convert e.g denormals. Returns the end of the value,
+ * or nullptr if there is no number at p.
+ */
+static const char *MyVectorStrToF(const char *p, const char *end, FP32 &fval) {
+  char   buff[64];
+  size_t n = std::min((size_t)(end - p), sizeof(buff) - 1);
+  memcpy(buff, p, n);
+  buff[n] = 0;
+
+  char *e = nullptr;
+  fval = strtof(buff, &e);
+  return (e == buff ? nullptr : p + (e - buff));
+}
+
+/* MyVectorParseFloats - parse the embedding string [str, str + len) e.g
+ * "[0.134511, -0.082219 ...]" into at most 'maxdim' floats at 'out'. The
+ * values are separated by spaces and/or commas, the brackets ([], {} or ())
+ * are optional. The string is parsed in place, no copies or allocations,
+ * and the parsing does not depend on the locale. Returns the dimension, or
+ * -1 with 'errmsg' set if the string is not a valid vector.
+ */
+static int MyVectorParseFloats(const char *str, size_t len, FP32 *out,
+                               size_t maxdim, string &errmsg) {
+  const char *p   = str;
+  const char *end = str + len;
+  char        endch = 0;
+
+  while (p < end && MyVectorIsSeparator(*p)) p++;
+  if (p < end && (*p == '[' || *p == '{' || *p == '(')) {
+    endch = (*p == '[' ? ']' : (*p == '{' ? '}' : ')'));
+    p++;
+  }
+
+  size_t dim = 0;
+  while (1) {
+    while (p < end && MyVectorIsSeparator(*p)) p++;
+    if (p == end || (endch && *p == endch) || (!endch && !*p))
+      break;
+
+    if (dim == maxdim) {
+      errmsg = "Input vector has more than " + to_string(maxdim) + " dimensions.";
+      return -1;
+    }
+
+    const char *val = p;
+    if (*p == '+') p++; /// from_chars() takes only '-'
+
+    FP32 fval = 0;
+#if defined(__cpp_lib_to_chars)
+    auto res = from_chars(p, end, fval);
+    const char *next = (res.ec == errc() ? res.ptr :
+                        (res.ec == errc::result_out_of_range ?
+                         MyVectorStrToF(p, end, fval) : nullptr));
+#else
+    const char *next = MyVectorStrToF(p, end, fval);
+#endif
+    if (!next || (next < end && !MyVectorIsSeparator(*next) &&
+                  *next != endch) || !std::isfinite(fval)) {
+      errmsg = "Input vector has an invalid value at position " +
+               to_string(val - str) + " : '" +
+               string(val, std::min((size_t)(end - val), (size_t)32)) + "'.";
+      return -1;
+    }
+
+    out[dim++] = fval;
+    p = next;
+  }
+
+  if (endch) {
+    if (p == end) {
+      errmsg = string("Input vector has no closing '") + endch + "'.";
+      return -1;
+    }
+    p++;
+  }
+  while (p < end && (MyVectorIsSeparator(*p) || !*p)) p++;
+  if (p < end) {
+    errmsg = "Input vector has extra characters at position " + to_string(p - str) + ".";
+    return -1;
+  }
+  if (!dim) {
+    errmsg = "Input vector is empty.";
+    return -1;
+  }
+
+  return (int)dim;
+}
+
+/* MyVectorHalfToFloat - IEEE754 half precision value to FP32 */
+static FP32 MyVectorHalfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp  = (h >> 10) & 0x1f;
+  uint32_t man  = h & 0x3ff;
+  uint32_t bits;
+
+  if (exp == 0x1f)      /// Inf, NaN
+    bits = sign | 0x7f800000 | (man << 13);
+  else if (exp)         /// normal
+    bits = sign | ((exp + 112) << 23) | (man << 13);
+  else if (!man)        /// zero
+    bits = sign;
+  else {                /// subnormal, normal in FP32
+    exp = 113;
+    while (!(man & 0x400)) {
+      man <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+  }
+
+  FP32 f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+/* MyVectorDecodeBase64 - decode the base64 string [src, src + len) into at
+ * most 'maxlen' bytes at 'dst'. Line breaks are skipped. Returns the number
+ * of bytes, or -1 if the string is not valid base64 or is too long.
+ */
+static long MyVectorDecodeBase64(const char *src, size_t len, unsigned char *dst,
+                                 size_t maxlen) {
+  static const signed char *table = [] {
+    static signed char t[256];
+    memset(t, -1, sizeof(t));
+    const char *chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 64; i++)
+      t[(unsigned char)chars[i]] = i;
+    return t;
+  }();
+
+  uint32_t acc = 0;
+  int      nbits = 0;
+  size_t   n = 0;
+  size_t   i = 0;
+  for (; i < len && src[i] != '='; i++) {
+    if (src[i] == '\n' || src[i] == '\r')
+      continue;
+    signed char v = table[(unsigned char)src[i]];
+    if (v < 0)
+      return -1;
+    acc = (acc << 6) | v;
+    nbits += 6;
+    if (nbits >= 8) {
+      if (n == maxlen)
+        return -1;
+      nbits -= 8;
+      dst[n++] = (unsigned char)(acc >> nbits);
+    }
+  }
+  for (; i < len; i++) /// only padding after '='
+    if (src[i] != '=' && src[i] != '\n' && src[i] != '\r')
+      return -1;
+
+  return (long)n;
+}
+
+/* MyVectorEncodeBase64 - base64 of [src, src + len) at 'dst', at most
+ * 'maxlen' characters. Returns the length, or -1 if there is no space.
+ */
+static long MyVectorEncodeBase64(const unsigned char *src, size_t len, char *dst,
+                                 size_t maxlen) {
+  static const char *chars =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  size_t n = ((len + 2) / 3) * 4;
+  if (n > maxlen)
+    return -1;
+
+  char *p = dst;
+  size_t i = 0;
+  for (; i + 2 < len; i += 3) {
+    uint32_t v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    *p++ = chars[(v >> 18) & 0x3f];
+    *p++ = chars[(v >> 12) & 0x3f];
+    *p++ = chars[(v >> 6) & 0x3f];
+    *p++ = chars[v & 0x3f];
+  }
+  if (i < len) {
+    uint32_t v = (src[i] << 16) | (i + 1 < len ? src[i + 1] << 8 : 0);
+    *p++ = chars[(v >> 18) & 0x3f];
+    *p++ = chars[(v >> 12) & 0x3f];
+    *p++ = (i + 1 < len ? chars[(v >> 6) & 0x3f] : '=');
+    *p++ = '=';
+  }
+
+  return (long)n;
+}
+
+/* MyVectorUnpackFloats - convert the packed values [src, src + len) in
+ * input format 'fmt' of myvector_construct() to at most 'maxdim' FP32s at
+ * 'out' :-
+ *   float_be : big endian FP32
+ *   fp16     : little endian IEEE754 half precision
+ *   int8     : signed 1-byte integers, the values are not scaled
+ *   base64   : base64 of little endian FP32 (as i=float)
+ * Returns the dimension, or -1 with 'errmsg' set.
+ */
+static int MyVectorUnpackFloats(const string &fmt, const char *src, size_t len,
+                                FP32 *out, size_t maxdim, string &errmsg) {
+  const unsigned char *p = (const unsigned char *)src;
+  size_t width = (fmt == "int8" ? 1 : (fmt == "fp16" ? 2 : 4));
+
+  if (fmt == "base64") {
+    long n = MyVectorDecodeBase64(src, len, (unsigned char *)out,
+                                  maxdim * sizeof(FP32));
+    if (n < 0 || (n % sizeof(FP32))) {
+      errmsg = "Input vector is not valid base64 of floats, or is too long.";
+      return -1;
+    }
+    len = n;
+  }
+  else if (fmt != "float_be" && fmt != "fp16" && fmt != "int8") {
+    errmsg = "Unknown input format i=" + fmt + ".";
+    return -1;
+  }
+  else if ((len % width) || (len / width) > maxdim) {
+    errmsg = "Input vector is malformed, length " + to_string(len) +
+             " is not a multiple of " + to_string(width) + " or is too long.";
+    return -1;
+  }
+
+  size_t dim = len / width;
+  if (!dim) {
+    errmsg = "Input vector is empty.";
+    return -1;
+  }
+
+  if (fmt == "float_be") {
+    for (size_t i = 0; i < dim; i++, p += 4) {
+      uint32_t bits = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                      ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+      memcpy(&out[i], &bits, sizeof(FP32));
+    }
+  }
+  else if (fmt == "fp16") {
+    for (size_t i = 0; i < dim; i++, p += 2)
+      out[i] = MyVectorHalfToFloat((uint16_t)(p[0] | (p[1] << 8)));
+  }
+  else if (fmt == "int8") {
+    for (size_t i = 0; i < dim; i++)
+      out[i] = (FP32)(signed char)p[i];
+  }
+
+  return (int)dim;
+}
+
 PLUGIN_EXPORT bool myvector_construct_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
     if (args->arg_count < 1 || args->arg_count > 2)
     {
@@ -1716,7 +3668,8 @@ PLUGIN_EXPORT bool myvector_construct_init(UDF_INIT *initid, UDF_ARGS *args, cha
  *             1) 4-byte Metadata
  *             2) 4-byte Checksum (computed from all the FP32s plus Metadata)
  *
- *             If input string is NULL, then NULL is returned.
+ *             If input string is NULL, then NULL is returned. An input
+ *             string that is not a valid vector is an error.
  */
 
 PLUGIN_EXPORT char *myvector_construct(UDF_INIT *initid, UDF_ARGS *args, char *result,
@@ -1727,11 +3680,15 @@ PLUGIN_EXPORT char *myvector_construct(UDF_INIT *initid, UDF_ARGS *args, char *r
   if (args->arg_count == 2)
     opt = args->args[1];
 
-  char *start = nullptr;
-  char endch;
+  if (!ptr) {
+    *is_null = 1;
+    return nullptr;
+  }
+
   char *retvec = initid->ptr;
   int  retlen  = 0;
   bool skipConvert = false;
+  string inputFormat;
 
   if (!opt || !args->lengths[1])
     opt = "i=string,o=float"; // i=string,o=float
@@ -1750,6 +3707,13 @@ PLUGIN_EXPORT char *myvector_construct(UDF_INIT *initid, UDF_ARGS *args, char *r
      */
     if (vo.getOption("i") == "float" && vo.getOption("o") == "float") 
       skipConvert = true;
+    /*
+     * i = float_be, fp16, int8, base64 : App is sending packed values in
+                                          another format, convert to floats
+     */
+    else if (vo.getOption("o") != "bv" && vo.getOption("i").length() &&
+             vo.getOption("i") != "string")
+      inputFormat = vo.getOption("i");
 
     /* For Binary Vectors, we will branch out to a separate routine */
     if (vo.getOption("o") == "bv")
@@ -1761,50 +3725,50 @@ PLUGIN_EXPORT char *myvector_construct(UDF_INIT *initid, UDF_ARGS *args, char *r
     // User is passing floats directly in bind variable or using "0x" literal
     if ((args->lengths[0] % sizeof(FP32)) != 0)
       SET_UDF_ERROR_AND_RETURN("Input vector is malformed, length not a multiple of sizeof(float) %lu.", args->lengths[0]);
+#if MYSQL_VERSION_ID >= 90000
+    /* VECTOR column value is the floats as is, no copy */
+    *length = args->lengths[0];
+    return ptr;
+#else
+    if (args->lengths[0] > MYVECTOR_CONSTRUCT_MAX_LEN - MYVECTOR_COLUMN_EXTRA_LEN)
+      SET_UDF_ERROR_AND_RETURN("Input vector is too long %lu.", args->lengths[0]);
     memcpy(retvec, ptr, args->lengths[0]);
     retlen = args->lengths[0];
     goto addChecksum;
+#endif
+  }
+
+  if (inputFormat.length()) {
+    string errmsg;
+    int    dim = MyVectorUnpackFloats(inputFormat, ptr, args->lengths[0], (FP32 *)retvec,
+                                      (MYVECTOR_CONSTRUCT_MAX_LEN - MYVECTOR_COLUMN_EXTRA_LEN) / sizeof(FP32),
+                                      errmsg);
+    if (dim < 0)
+      SET_UDF_ERROR_AND_RETURN("%s", errmsg.c_str());
+    retlen = dim * sizeof(FP32);
+    goto addChecksum;
   }
 
   /* Below code implements conversion from string "[0.134511 -0.082219 ...]" to
    * floats followed by metadata & checksum.
    */
-  if ((start = strchr(ptr, '[')))
-    endch = ']';
-  else if ((start = strchr(ptr, '{')))
-    endch = '}';
-  else if ((start = strchr(ptr, '(')))
-    endch = ')';
-  else
   {
-    start = ptr;
-    endch = '\0';
+    string errmsg;
+    int    dim = MyVectorParseFloats(ptr, args->lengths[0], (FP32 *)retvec,
+                                     (MYVECTOR_CONSTRUCT_MAX_LEN - MYVECTOR_COLUMN_EXTRA_LEN) / sizeof(FP32),
+                                     errmsg);
+    if (dim < 0)
+      SET_UDF_ERROR_AND_RETURN("%s", errmsg.c_str());
+    retlen = dim * sizeof(FP32);
   }
-  if (endch) start++;
-
-  ptr = start;
-
-  while (*ptr && *ptr != endch) {
-    while (*ptr && (*ptr == ' ' || *ptr == ',')) ptr++;
-    char *p1 = ptr;
-    while (*ptr != ' ' && *ptr != ',' && *ptr != endch) ptr++;
-    char buff[64];
-    strncpy(buff,p1,(ptr-p1));
-
-    // TODO - atof() returns 0 if not a valid float
-    FP32 fval = atof(buff); // change these 2 lines for FP16, INT8 etc
-    memcpy(&retvec[retlen], &fval, sizeof(FP32)); 
-    
-    retlen += sizeof(FP32);
-  } // while
 
 addChecksum:
 #if MYSQL_VERSION_ID < 90000
-  unsigned int metadata = MYVECTOR_V1_FP32_METADATA;
+  unsigned int metadata = MYVECTOR_V2_FP32_METADATA;
   memcpy(&retvec[retlen], &metadata, sizeof(metadata));
   retlen += sizeof(metadata);
  
-  ha_checksum cksum = my_checksum(0, (const unsigned char *)retvec, retlen);
+  ha_checksum cksum = MyVectorChecksum((const unsigned char *)retvec, retlen);
   memcpy(&retvec[retlen], &cksum, sizeof(cksum));
   retlen += sizeof(cksum);
 #endif
@@ -1817,9 +3781,25 @@ addChecksum:
 PLUGIN_EXPORT void myvector_construct_deinit(UDF_INIT *initid)
 { if (initid && initid->ptr) free(initid->ptr); }
 
+/* MyVectorFloatToChars - 'fval' at p, with 'precision' significant digits
+ * or the shortest round trip string if 'precision' is 0. Returns the end,
+ * or nullptr if there is no space till 'end'.
+ */
+static char *MyVectorFloatToChars(char *p, char *end, FP32 fval, int precision) {
+#if defined(__cpp_lib_to_chars)
+  auto res = (precision ? to_chars(p, end, fval, chars_format::general, precision)
+                        : to_chars(p, end, fval));
+  return (res.ec == errc() ? res.ptr : nullptr);
+#else
+  int n = snprintf(p, end - p, "%.*g", (precision ? precision : 9), fval);
+  return (n < 0 || n >= end - p ? nullptr : p + n);
+#endif
+}
+
 PLUGIN_EXPORT bool myvector_display_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
   if (args->arg_count == 0 || args->arg_count > 2) {
-    strcpy(message, "Incorrect arguments, usage : myvector_display(vec_col_expr, ['prec']).");
+    strcpy(message, "Incorrect arguments, usage : myvector_display(vec_col_expr, "
+           "['prec' | 'o=text|json|space|base64[,prec=N|shortest]']).");
     return true; // error
   }
   initid->max_length = MYVECTOR_DISPLAY_MAX_LEN;
@@ -1843,23 +3823,44 @@ PLUGIN_EXPORT char *myvector_display(UDF_INIT *initid, UDF_ARGS *args, char *res
    * at highest 8 bytes. Need to verify that when supporting double, FP16 etc.
    */
 
-  int precision = 0;
+  /* 2nd argument is the precision e.g '7', or options e.g 'o=json,prec=7'.
+   * prec=shortest is the shortest round trip string of each float.
+   * Output formats :-
+   *   text   : [0.134511, -0.082219, ...] (default)
+   *   json   : [0.134511,-0.082219,...], Inf and NaN are null
+   *   space  : 0.134511 -0.082219 ...
+   *   base64 : base64 of the stored floats (or bytes of a binary vector)
+   */
+  int    precision = MYVECTOR_DISPLAY_DEF_PREC;
+  string format    = "text";
   if (args->arg_count > 1 && args->args[1] && args->lengths[1]) {
-    precision = atoi(args->args[1]);
+    string opt(args->args[1], args->lengths[1]);
+    if (isdigit((unsigned char)opt[0])) {
+      precision = atoi(opt.c_str());
+      if (!precision) precision = MYVECTOR_DISPLAY_DEF_PREC;
+    }
+    else {
+      MyVectorOptions vo(opt);
+      if (!vo.isValid())
+        SET_UDF_ERROR_AND_RETURN("Invalid myvector_display() options %s.", opt.c_str());
+      if (vo.getOption("o").length())
+        format = vo.getOption("o");
+      if (vo.getOption("prec") == "shortest")
+        precision = 0; /// MyVectorFloatToChars() round trip
+      else if (vo.getOption("prec").length()) {
+        precision = atoi(vo.getOption("prec").c_str());
+        if (!precision) precision = MYVECTOR_DISPLAY_DEF_PREC;
+      }
+    }
+    if (format != "text" && format != "json" && format != "space" && format != "base64")
+      SET_UDF_ERROR_AND_RETURN("Unknown myvector_display() output format o=%s.", format.c_str());
   }
-  if (!precision) precision = MYVECTOR_DISPLAY_DEF_PREC;
-  
-  stringstream ostr;
 
 #if MYSQL_VERSION_ID < 90000
-  ha_checksum cksum1;
-  char        *raw = args->args[0];
-  /* Checksum is at the end */
-  memcpy((char *)&cksum1, &(raw[args->lengths[0] - sizeof(ha_checksum)]),
-           sizeof(ha_checksum));
-  ha_checksum cksum2 = my_checksum(0, (const unsigned char *)raw, 
-                                   args->lengths[0] - sizeof(ha_checksum));
-  if (cksum1 != cksum2) {
+  /* myvector_verify_checksum=OFF - verified only by myvector_is_valid() */
+  if (args->lengths[0] < MYVECTOR_COLUMN_EXTRA_LEN ||
+      (myvector_verify_checksum &&
+       !MyVectorVerifyChecksum(args->args[0], args->lengths[0]))) {
     *error   = 1;
     return "<invalid vector>";
   }
@@ -1871,11 +3872,13 @@ PLUGIN_EXPORT char *myvector_display(UDF_INIT *initid, UDF_ARGS *args, char *res
   memcpy((char *)&metadata, &bvec[args->lengths[0] - MYVECTOR_COLUMN_EXTRA_LEN],
          sizeof(metadata));
 
-  if (metadata == MYVECTOR_V1_FP32_METADATA) {
+  if (metadata == MYVECTOR_V1_FP32_METADATA ||
+      metadata == MYVECTOR_V2_FP32_METADATA) {
     bvec = nullptr;
     dim  = MyVectorDimFromStorageLength(args->lengths[0]);
   }
-  else if (metadata == MYVECTOR_V1_BV_METADATA) {
+  else if (metadata == MYVECTOR_V1_BV_METADATA ||
+           metadata == MYVECTOR_V2_BV_METADATA) {
     fvec = nullptr;
     dim  = MyVectorBVDimFromStorageLength(args->lengths[0]);
     dim  = dim / 8; /* bit-packet */
@@ -1888,24 +3891,56 @@ PLUGIN_EXPORT char *myvector_display(UDF_INIT *initid, UDF_ARGS *args, char *res
   dim  = MyVectorDimFromStorageLength(args->lengths[0]);
 #endif
 
-  ostr << "[";
-  ostr << setprecision(precision);
-  for (int i = 0 ; i < dim; i++) {
-    if (i) ostr << ", ";
+  result = initid->ptr;
+  char *p   = result;
+  char *end = result + MYVECTOR_DISPLAY_MAX_LEN;
+
+  if (format == "base64") {
+    long n = (fvec ? MyVectorEncodeBase64((const unsigned char *)fvec, dim * sizeof(FP32),
+                                          p, MYVECTOR_DISPLAY_MAX_LEN)
+                   : MyVectorEncodeBase64(bvec, dim, p, MYVECTOR_DISPLAY_MAX_LEN));
+    if (n < 0)
+      SET_UDF_ERROR_AND_RETURN("Vector is too long for myvector_display() dim=%d.", dim);
+    *length = n;
+    return result;
+  }
+
+  bool        json    = (format == "json");
+  bool        bracket = (format != "space");
+  const char *sep     = (format == "text" ? ", " : (json ? "," : " "));
+  size_t      seplen  = strlen(sep);
+
+  if (bracket) *p++ = '[';
+  for (int i = 0 ; i < dim && p; i++) {
+    if (end - p < 8) { /// separator, null, ']'
+      p = nullptr;
+      break;
+    }
+    if (i) {
+      memcpy(p, sep, seplen);
+      p += seplen;
+    }
     if (fvec) {
-      ostr << *fvec;
+      if (json && !std::isfinite(*fvec)) {
+        memcpy(p, "null", 4);
+        p += 4;
+      }
+      else {
+        p = MyVectorFloatToChars(p, end - 1, *fvec, precision);
+      }
       fvec++;
     }
     else {
-      ostr << (unsigned int)*bvec;
+      auto res = to_chars(p, end - 1, (unsigned int)*bvec);
+      p = (res.ec == errc() ? res.ptr : nullptr);
       bvec++;
     }
   }
-  ostr << "]";
+  if (!p)
+    SET_UDF_ERROR_AND_RETURN("Vector is too long for myvector_display() dim=%d.", dim);
+  if (bracket) *p++ = ']';
 
-  result = initid->ptr;
-  strcpy(result, ostr.str().c_str());
-  *length = ostr.str().length();
+  *length = p - result;
 
   return result;
 }
@@ -1914,8 +3949,154 @@ PLUGIN_EXPORT void myvector_display_deinit(UDF_INIT *initid)
 { if (initid && initid->ptr) free(initid->ptr); }
 
 /* UDF MYVECTOR_DISTANCE() Implementation */
-PLUGIN_EXPORT bool myvector_distance_init(UDF_INIT *, UDF_ARGS * args, char * message)
+enum MyVectorDistanceMeasure {
+  MYVECTOR_DIST_NONE,
+  MYVECTOR_DIST_L2,
+  MYVECTOR_DIST_IP,
+  MYVECTOR_DIST_COSINE
+};
+
+/* getDistanceMeasure - distance measure for a name, MYVECTOR_DIST_NONE if
+ * the measure is not known.
+ */
+static MyVectorDistanceMeasure getDistanceMeasure(const char *disttype, unsigned long len)
+{
+  string dist(disttype, len);
+
+  if (!strcasecmp(dist.c_str(), "L2") || !strcasecmp(dist.c_str(), "EUCLIDEAN"))
+    return MYVECTOR_DIST_L2;
+  else if (!strcasecmp(dist.c_str(), "Cosine"))
+    return MYVECTOR_DIST_COSINE;
+  else if (!strcasecmp(dist.c_str(), "IP"))
+    return MYVECTOR_DIST_IP;
+
+  return MYVECTOR_DIST_NONE;
+}
+
+/* MyVectorDistanceState - state of myvector_distance(), myvector_l2(),
+ * myvector_ip() and myvector_cosine(), set up in _init(). The hnswlib
+ * function is bound to the measure and dimension of the first row, a
+ * constant query vector is copied and its norm computed once.
+ */
+struct MyVectorDistanceState
+{
+  MyVectorDistanceMeasure  measure{MYVECTOR_DIST_NONE}; /// of 'kernel'
+  int                      measureArg{-1};  /// measure is not constant
+  hnswlib::DISTFUNC<FP32>  kernel{nullptr}; /// L2, or IP for IP & Cosine
+  size_t                   dim{0};          /// of 'kernel'
+  int                      queryArg{-1};    /// constant vector argument
+  vector<FP32>             query;
+  double                   queryNorm{0.0};  /// squared, Cosine only
+};
+
+static void bindDistanceKernel(MyVectorDistanceState *st,
+                               MyVectorDistanceMeasure measure, size_t dim)
+{
+  if (measure == MYVECTOR_DIST_L2) {
+    hnswlib::L2Space sp(dim);
+    st->kernel = sp.get_dist_func();
+  }
+  else {
+    hnswlib::InnerProductSpace sp(dim);
+    st->kernel = sp.get_dist_func();
+  }
+  st->measure = measure;
+  st->dim     = dim;
+
+  /* hnswlib IP distance is 1 - v1.v2 */
+  if (measure == MYVECTOR_DIST_COSINE && st->query.size() == dim)
+    st->queryNorm = 1.0 - st->kernel(st->query.data(), st->query.data(), &dim);
+}
+
+/* initDistanceState - common _init() of the distance UDFs. Arguments 0 & 1
+ * are the vectors, 'measure' is MYVECTOR_DIST_NONE if it is resolved per
+ * row from argument 'measureArg'.
+ */
+static bool initDistanceState(UDF_INIT *initid, UDF_ARGS *args,
+                              MyVectorDistanceMeasure measure, int measureArg,
+                              char *message)
+{
+  MyVectorDistanceState *st = new MyVectorDistanceState();
+  st->measure    = measure;
+  st->measureArg = measureArg;
+
+  for (int i = 0; i < 2; i++) {
+    if (!args->args[i]) /// not a constant
+      continue;
+    int dim = MyVectorDimFromStorageLength(args->lengths[i]);
+    if (dim <= 0) {
+      strcpy(message, "Vector argument is malformed.");
+      delete st;
+      return true; /// error
+    }
+    st->queryArg = i;
+    st->query.assign((const FP32 *)args->args[i], (const FP32 *)args->args[i] + dim);
+    if (measure != MYVECTOR_DIST_NONE)
+      bindDistanceKernel(st, measure, dim);
+    break;
+  }
+
+  initid->maybe_null = 1;
+  initid->ptr        = (char *)st;
+  return false;
+}
+
+/* rowDistance - distance of the 2 vectors of a row, both vectors should
+ * have the same dimension.
+ */
+static double rowDistance(UDF_INIT *initid, UDF_ARGS *args, char *is_null,
+                          char *error)
+{
+  MyVectorDistanceState *st = (MyVectorDistanceState *)initid->ptr;
+
+  if (!args->args[0] || !args->args[1] ||
+      args->lengths[0] != args->lengths[1]) {
+    *error   = 1;
+    *is_null = 1;
+    return 0.0;
+  }
+
+  MyVectorDistanceMeasure measure = st->measure;
+  if (st->measureArg >= 0) {
+    if (!args->args[st->measureArg] ||
+        (measure = getDistanceMeasure(args->args[st->measureArg],
+                                      args->lengths[st->measureArg])) == MYVECTOR_DIST_NONE) {
+      *error = 1; // NULL or incorrect distance measure
+      return 0.0;
+    }
+  }
+
+  size_t dim = st->dim;
+  if (args->lengths[0] != MyVectorStorageLength(dim) || measure != st->measure) {
+    int rdim = MyVectorDimFromStorageLength(args->lengths[0]);
+    if (rdim <= 0 || (st->queryArg >= 0 && (size_t)rdim != st->query.size())) {
+      *error   = 1;
+      *is_null = 1;
+      return 0.0;
+    }
+    bindDistanceKernel(st, measure, rdim);
+    dim = rdim;
+  }
+
+  const FP32 *v1 = (st->queryArg == 0 ? st->query.data() : (const FP32 *)args->args[0]);
+  const FP32 *v2 = (st->queryArg == 1 ? st->query.data() : (const FP32 *)args->args[1]);
+
+  double dist = st->kernel(v1, v2, &dim);
+  if (measure != MYVECTOR_DIST_COSINE)
+    return dist;
+
+  double norm1 = (st->queryArg == 0 ? st->queryNorm : 1.0 - st->kernel(v1, v1, &dim));
+  double norm2 = (st->queryArg == 1 ? st->queryNorm : 1.0 - st->kernel(v2, v2, &dim));
+  double t     = sqrt(norm1 * norm2);
+  return (t ? 1.0 - (1.0 - dist) / t : 1.0);
+}
+
+/* myvector_distance(v1, v2 [, measure]) - the measure is bound in _init()
+ * if it is a constant (or not given i.e L2).
+ */
+PLUGIN_EXPORT bool myvector_distance_init(UDF_INIT *initid, UDF_ARGS * args, char * message)
 {
+    initid->ptr = nullptr;
     if (args->arg_count < 2)
     {
         strcpy(message, "myvector_distance() requires atleast 2 arguments.");
@@ -1926,7 +4107,25 @@ PLUGIN_EXPORT bool myvector_distance_init(UDF_INIT *, UDF_ARGS * args, char * me
         strcpy(message, "Too many arguments, usage : myvector_distance(v1,v2 [,dist]).");
         return true; /// error
     }
-    return false;
+
+    MyVectorDistanceMeasure measure = MYVECTOR_DIST_L2; // default
+    int measureArg = -1;
+    if (args->arg_count == 3)
+    {
+        if (!args->args[2]) /// not a constant, resolved for each row
+        {
+            measure    = MYVECTOR_DIST_NONE;
+            measureArg = 2;
+        }
+        else if ((measure = getDistanceMeasure(args->args[2], args->lengths[2])) ==
+                 MYVECTOR_DIST_NONE)
+        {
+            strcpy(message, "Incorrect distance measure, use L2, EUCLIDEAN, Cosine or IP.");
+            return true; /// error
+        }
+    }
+
+    return initDistanceState(initid, args, measure, measureArg, message);
 }
 
 PLUGIN_EXPORT bool myvector_construct_binaryvector_init(UDF_INIT *initid, UDF_ARGS *args, char *message) {
@@ -1955,55 +4154,70 @@ PLUGIN_EXPORT double myvector_hamming_distance(UDF_INIT *, UDF_ARGS *args, char
   return HammingDistanceFn(v1, v2, &dim);
 }
 
-PLUGIN_EXPORT double myvector_distance(UDF_INIT *, UDF_ARGS *args, char *is_null,
+PLUGIN_EXPORT double myvector_distance(UDF_INIT *initid, UDF_ARGS *args, char *is_null,
                           char *error) {
-  double dist = 0.0;
-  FP32 *v1 = (FP32 *)(args->args[0]);
-  FP32 *v2 = (FP32 *)(args->args[1]);
-  int dim1 = MyVectorDimFromStorageLength(args->lengths[0]);
-  int dim2 = MyVectorDimFromStorageLength(args->lengths[1]);
-
-  /* Unsafe hack - keep going if 2 vectors have different dimension? */
-  if (dim1 != dim2) {
-    if (dim2 > dim1)
-      dim2 = dim1;
-    else
-      dim1 = dim2;
-  }
+  return rowDistance(initid, args, is_null, error);
+}
 
-  if (!v1 || !v2  || (dim1 != dim2) || (dim1 <= 0)) {
-    *error = 1;
-    *is_null = 1;
-    return 0.0;
+PLUGIN_EXPORT void myvector_distance_deinit(UDF_INIT *initid)
+{
+  if (initid && initid->ptr)
+    delete (MyVectorDistanceState *)initid->ptr;
+}
+
+/* myvector_l2(v1, v2), myvector_ip(v1, v2), myvector_cosine(v1, v2) -
+ * myvector_distance() with the measure in the name.
+ */
+PLUGIN_EXPORT bool myvector_l2_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 2) {
+    strcpy(message, "Incorrect arguments, usage : myvector_l2(v1, v2).");
+    return true;
   }
+  return initDistanceState(initid, args, MYVECTOR_DIST_L2, -1, message);
+}
+
+PLUGIN_EXPORT double myvector_l2(UDF_INIT *initid, UDF_ARGS *args, char *is_null,
+                                 char *error) {
+  return rowDistance(initid, args, is_null, error);
+}
 
-  const char *disttype = "L2"; // default
-  if (args->arg_count == 3)
-     disttype = args->args[2];
+PLUGIN_EXPORT void myvector_l2_deinit(UDF_INIT *initid)
+{ myvector_distance_deinit(initid); }
 
-  double (*distfn)(const FP32 *v1, const FP32 *v2, int dim);
-  // TODO : Cache function pointer in _init() if the 3rd argument is a constant literal
-  if (!disttype) {
-    *error = 1; // NULL distance measure
-    return 0.0;
+PLUGIN_EXPORT bool myvector_ip_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 2) {
+    strcpy(message, "Incorrect arguments, usage : myvector_ip(v1, v2).");
+    return true;
   }
+  return initDistanceState(initid, args, MYVECTOR_DIST_IP, -1, message);
+}
 
-  if (!strcasecmp(disttype, "L2") || !strcasecmp(disttype, "EUCLIDEAN"))
-    distfn = computeL2Distance;
-  else if (!strcasecmp(disttype, "Cosine"))
-    distfn = computeCosineDistance;
-  else if (!strcasecmp(disttype, "IP"))
-    distfn = computeIPDistance;
-  else {
-    *error = 1; // Incorrect distance measure
-    return 0.0;
+PLUGIN_EXPORT double myvector_ip(UDF_INIT *initid, UDF_ARGS *args, char *is_null,
+                                 char *error) {
+  return rowDistance(initid, args, is_null, error);
+}
+
+PLUGIN_EXPORT void myvector_ip_deinit(UDF_INIT *initid)
+{ myvector_distance_deinit(initid); }
+
+PLUGIN_EXPORT bool myvector_cosine_init(UDF_INIT *initid, UDF_ARGS *args, char *message)
+{
+  if (args->arg_count != 2) {
+    strcpy(message, "Incorrect arguments, usage : myvector_cosine(v1, v2).");
+    return true;
   }
+  return initDistanceState(initid, args, MYVECTOR_DIST_COSINE, -1, message);
+}
 
-  dist = distfn(v1, v2, dim1);
-  return dist;
+PLUGIN_EXPORT double myvector_cosine(UDF_INIT *initid, UDF_ARGS *args, char *is_null,
+                                     char *error) {
+  return rowDistance(initid, args, is_null, error);
 }
 
-PLUGIN_EXPORT void myvector_distance_deinit(UDF_INIT *initid) {}
+PLUGIN_EXPORT void myvector_cosine_deinit(UDF_INIT *initid)
+{ myvector_distance_deinit(initid); }
 
 
 PLUGIN_EXPORT bool myvector_search_open_udf_init(UDF_INIT *initid,
@@ -2016,12 +4230,16 @@ PLUGIN_EXPORT bool myvector_search_open_udf_init(UDF_INIT *initid,
 }
 
 
-void BuildMyVectorIndexSQL(const char *db, const char *table, const char *idcol,
+bool BuildMyVectorIndexSQL(const char *db, const char *table, const char *idcol,
                            const char *veccol, const char *action,
                            const char *trackingColumn,
-                           AbstractVectorIndex *vi,
+                           const VectorIndexHandle &vi,
+                           const VectorIndexHandle &replaces,
+                           const MyVectorBuildOptions &bo,
                            char *errorbuf);
 
+string myvector_build_progress(const string &vecid);
+
 void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
               char *action, char *extra, char *result)
 {
@@ -2036,9 +4254,12 @@ void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
      5. If tracking column technique -> call myvector("refresh") - index should be loaded first.
         refresh will not persist. After reboot/restart, call myvector("load") followed by myvector("refresh")
      6. For explicit persist  -> call myvector("save"), needed after "refresh"
+     7. Build of a HNSW index failed midway (e.g restart) -> call myvector("resume"),
+        the build continues from its last partial save. If the table was changed after
+        that save, resume fails and a "build" is needed.
     */
 
-    AbstractVectorIndex *vi = g_indexes.get(vecid);
+    VectorIndexHandle vi = g_indexes.get(vecid);
     if (!vi) {
       vi = g_indexes.open(vecid, details, action);
       if (!vi) {
@@ -2047,10 +4268,12 @@ void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
       }
       existing = false;
     }
-    SharedLockGuard l(vi);
+
+    VectorIndexHandle vb = vi; /* index that "build" fills */
 
     string trackingColumn = "", threads = "";
     int    nthreads = 0;
+    MyVectorBuildOptions bo;
 
     MyVectorOptions vo(details);
     if (vo.getOption("track").length()) {
@@ -2067,38 +4290,66 @@ void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
     else {
        nthreads = myvector_index_bg_threads;
     }
+    /* build=snapshot - no LOCK TABLES, DML continues during the build */
+    bo.nthreads = nthreads;
+    bo.snapshot = (vo.getOption("build") == "snapshot" && !strcmp(action, "build"));
+    bo.resume   = !strcmp(action, "resume");
 
     if (!strcmp(action, "save")) {
       vi->saveIndex(myvector_index_dir);
     }
     else if (!strcmp(action, "status"))
     {
-        string s = vi->getStatus();
+        string s = vi->getStatus() + myvector_build_progress(vecid);
         strcpy(result, s.c_str());
     }
     else if (!strcmp(action, "drop")) {
-      vi->dropIndex(myvector_index_dir);
-      l.clear();
+      /* queries already running keep the index in memory till they end */
       g_indexes.close(vi);
+      vi->dropIndex(myvector_index_dir);
       vi = nullptr;
     }
  
     else if (!strcmp(action, "load")) {
       debug_print("Loading index %s.", vecid);
-      vi->loadIndex(myvector_index_dir); // will handle 'reload' also
+      if (existing) { /* reload into a new index, the open one keeps serving */
+        vb = VectorIndexCollection::create(vi->getName(), details);
+        vb->loadIndex(myvector_index_dir);
+        if (!g_indexes.replace(vi, vb))
+          strcpy(result, "Vector index was dropped during load.");
+      }
+      else {
+        vi->loadIndex(myvector_index_dir);
+      }
     }
-    else if (!strcmp(action, "build")) {
-      vi->dropIndex(myvector_index_dir);
+    else if (!strcmp(action, "build") || bo.resume) {
+      if (existing) {
+        /* Shadow build - the open index keeps serving queries, the new
+         * index replaces it when built & saved.
+         */
+        vb = VectorIndexCollection::create(vi->getName(), details);
+      }
+      else if (!bo.resume) {
+        vi->dropIndex(myvector_index_dir);
+      }
 
-      vi->initIndex(); // start new
+      if (!bo.resume) {
+        vb->initIndex(); // start new
+      }
+      else if (!vb->loadBuildState(myvector_index_dir, bo.resumeKey,
+                                   bo.resumeBinlogFile, bo.resumeBinlogPos)) {
+        strcpy(result, "No partial build found to resume.");
+        return;
+      }
 
-      if (nthreads >=2 ) vi->startParallelBuild(nthreads);
+      /* indexes that take concurrent inserts are built by parallel scans */
+      if (nthreads >=2 && !vb->supportsConcurrentUpdates()) vb->startParallelBuild(nthreads);
     }
     else if (!strcmp(action, "refresh")) {
-      if (nthreads >= 2) vi->startParallelBuild(nthreads);
+      if (nthreads >= 2 && !vi->supportsConcurrentUpdates()) vi->startParallelBuild(nthreads);
     }
 
-    if (!strcmp(action, "build") || !strcmp(action,"refresh")) {
+    if (!strcmp(action, "build") || !strcmp(action,"refresh") || bo.resume) {
       char errorbuf[1024];
       char *db, *table, *veccol;
       db = vecid;
@@ -2108,9 +4359,15 @@ void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
       veccol = strchr(table, '.');
       *veccol = 0;
       veccol++;
-      BuildMyVectorIndexSQL(db, table, pkidcol, veccol, action, trackingColumn.c_str(),
-                            vi, errorbuf);
+      bool built = BuildMyVectorIndexSQL(db, table, pkidcol, veccol, action,
+                                         trackingColumn.c_str(), vb,
+                                         (vb != vi ? vi : nullptr), bo,
+                                         errorbuf);
       strcpy(result, errorbuf);
+      if (!built) /* old index stays open, a partial graph is not saved */
+        return;
+      if (vb != vi)
+        vi = vb; /* old index is freed when its last query is done */
       if (!strcmp(action, "refresh")) {
          unsigned long lastts = vi->getUpdateTs();
          char timebuf[64];
@@ -2119,7 +4376,7 @@ void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
          strcat(result, timebuf);
       }
 
-      vi->saveIndex(myvector_index_dir, action);
+      vi->saveIndex(myvector_index_dir, (bo.resume ? "build" : action));
     }
     return;
 
@@ -2169,7 +4426,8 @@ PLUGIN_EXPORT char* myvector_search_save_udf(
     char *action  =  args->args[3];
     char *extra   =  args->args[4];
   
-    if (!g_indexes.get(vecid)) {
+    VectorIndexHandle vi = g_indexes.get(vecid);
+    if (!vi) {
       my_plugin_log_message(&gplugin, MY_ERROR_LEVEL,
               "Index %s is not opened for build/refresh.", vecid);
       strcpy(result, "FAILED");
@@ -2177,7 +4435,6 @@ PLUGIN_EXPORT char* myvector_search_save_udf(
       return result;
     }
 
-    AbstractVectorIndex *vi = g_indexes.get(vecid);
     vi->saveIndex(myvector_index_dir, action);
     return result;
 }
@@ -2189,14 +4446,15 @@ PLUGIN_EXPORT bool myvector_search_add_row_udf_init(UDF_INIT *initid,
   char *vecid   =  args->args[0];
   char *details =  args->args[1];
 
-  /* Check if index is open and 'cache' it */
-  if (!g_indexes.get(vecid)) {
+  /* Check if index is open and 'cache' it, the handle is held till _deinit() */
+  VectorIndexHandle vi = g_indexes.get(vecid);
+  if (!vi) {
     my_plugin_log_message(&gplugin, MY_ERROR_LEVEL,
               "Index %s is not opened for update.", vecid);
     return true;
   }
 
-  initid->ptr = (char *)(g_indexes.get(vecid));
+  initid->ptr = (char *)(new VectorIndexHandle(vi));
   return false;
 }
 
@@ -2213,9 +4471,9 @@ PLUGIN_EXPORT long long myvector_search_add_row_udf(
   int  dims         = MyVectorDimFromStorageLength(args->lengths[3]);
 
 
-  AbstractVectorIndex *vi = (AbstractVectorIndex *)(initid->ptr);
+  VectorIndexHandle *vi = (VectorIndexHandle *)(initid->ptr);
   if (vi) {
-    vi->insertVector((FP32 *)vecval, dims, pkid);
+    (*vi)->insertVector((FP32 *)vecval, dims, pkid);
   } else {
     *error = 1;
     return 0;
@@ -2227,17 +4485,19 @@ PLUGIN_EXPORT long long myvector_search_add_row_udf(
 /* UDF : myvector_search_add_row_udf() */
 PLUGIN_EXPORT void myvector_search_add_row_udf_deinit(UDF_INIT *initid) {
   /* build/rebuild/refresh complete - persist the index if it is capable */
-  AbstractVectorIndex *vi = (AbstractVectorIndex *)(initid->ptr);
+  VectorIndexHandle *vi = (VectorIndexHandle *)(initid->ptr);
 
   if (vi) {
     my_plugin_log_message(&gplugin, MY_INFORMATION_LEVEL, 
-      "Not Saving index %s to disk", vi->getName().c_str());
+      "Not Saving index %s to disk", (*vi)->getName().c_str());
 
-    // vi->saveIndex(myvector_index_dir);
+    // (*vi)->saveIndex(myvector_index_dir);
 
     my_plugin_log_message(&gplugin, MY_INFORMATION_LEVEL, 
-      "Not Saving index %s to disk completed", vi->getName().c_str());
+      "Not Saving index %s to disk completed", (*vi)->getName().c_str());
 
+    delete vi; /* release the index handle */
+    initid->ptr = nullptr;
   }
 
   return;
@@ -2271,19 +4531,11 @@ PLUGIN_EXPORT long long myvector_is_valid(
     return 0;
   }
   
-  ha_checksum cksum1;
-  char        *raw = args->args[0];
-
-  /* Checksum is at the end */
-  memcpy((char *)&cksum1, &(raw[args->lengths[0] - sizeof(ha_checksum)]),
-           sizeof(ha_checksum));
-  ha_checksum cksum2 = my_checksum(0, (const unsigned char *)raw, 
-                                   args->lengths[0] - sizeof(ha_checksum));
-  if (cksum1 != cksum2) {
-    debug_print("myvector_is_valid checksum failure (%u != %u)",
-                cksum1, cksum2);
+#if MYSQL_VERSION_ID < 90000
+  /* Always verified, even with myvector_verify_checksum=OFF */
+  if (!MyVectorVerifyChecksum(args->args[0], args->lengths[0]))
     return 0;
-  }
+#endif
   
   return 1; // success
 }
@@ -2331,20 +4583,26 @@ bool isAfter(const string & binlogfile2, const size_t binlogpos2,
 void myvector_table_op(const string & dbname, const string & tbname, 
                        const string & cname, unsigned int pkid,
                        vector<unsigned char> & vec,
-                       const string & binlogfile, const size_t & binlogpos) {
+                       const string & binlogfile, const size_t & binlogpos,
+                       const string & partition, KeyTypeInteger docid) {
     string vecid = dbname + "." + tbname + "." + cname;
-    AbstractVectorIndex *vi = g_indexes.get(vecid);
+    VectorIndexHandle vi = g_indexes.get(vecid);
 
     if (vi)
     {
-        SharedLockGuard l(vi);
         string binlogfileold;
         size_t binlogposold;
 
         vi->getLastUpdateCoordinates(binlogfileold, binlogposold);
         if (isAfter(binlogfile, binlogpos, binlogfileold, binlogposold))
         {
-            vi->insertVector(vec.data(), vi->getDimension(), pkid);
+            if (vi->getPartitionColumn().length())
+                vi->insertVectorPartition(vec.data(), vi->getDimension(), pkid,
+                                          docid, partition);
+            else if (vi->getDocIdColumn().length())
+                vi->insertVectorDoc(vec.data(), vi->getDimension(), pkid, docid);
+            else
+                vi->insertVector(vec.data(), vi->getDimension(), pkid);
         }
         else
         { 
@@ -2363,11 +4621,10 @@ void myvector_checkpoint_index(const string & dbtable, const string & veccol,
                                const string & binlogFile, size_t binlogPos)
 {
     string vecid = dbtable + "." + veccol;
-    AbstractVectorIndex *vi = g_indexes.get(vecid);
+    VectorIndexHandle vi = g_indexes.get(vecid);
 
     if (vi)
     {
-        SharedLockGuard l(vi);
         string binlogfileold;
         size_t binlogposold;
 
@@ -2382,6 +4639,16 @@ void myvector_checkpoint_index(const string & dbtable, const string & veccol,
     }
 }
 
+/* myvector_replace_index() - Make the shadow index built by
+ * BuildMyVectorIndexSQL() the open index in place of 'oldvi'. Called with
+ * binlog_stream_mutex_ held, so that a checkpoint of the old index cannot
+ * write over the files just saved by the build.
+ */
+bool myvector_replace_index(const VectorIndexHandle &oldvi, const VectorIndexHandle &newvi)
+{
+    return g_indexes.replace(oldvi, newvi);
+}
+
 string myvector_find_earliest_binlog_file() {
   return g_indexes.FindEarliestBinlogFile();
 }
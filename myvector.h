@@ -26,6 +26,7 @@
 #include <string>
 #include <mutex>
 #include <shared_mutex>
+#include <memory>
 #include <map>
 #include <unordered_map>
 
@@ -55,6 +56,27 @@ typedef void*       VectorPtr;
 
 using namespace std;
 
+/* VectorSearchParams - search knobs of a single query. They are passed down
+ * with each search, so concurrent queries can use different values. A 0
+ * value means the index default (e.g ef_search=<n> in the index options).
+ */
+struct VectorSearchParams
+{
+    int    ef_search{0};
+    double target_recall{0}; /// > 0 : adaptive early termination (HNSW)
+};
+
+/* MyVectorBuildOptions - how BuildMyVectorIndexSQL() reads the base table */
+struct MyVectorBuildOptions
+{
+    int            nthreads{0};
+    bool           snapshot{false};  /// build=snapshot, no LOCK TABLES
+    bool           resume{false};    /// continue a partial build after resumeKey
+    KeyTypeInteger resumeKey{0};
+    string         resumeBinlogFile; /// table rows of the partial build are as of
+    size_t         resumeBinlogPos{0}; /// this binlog position
+};
+
 /* Interface for various types of vector indexes. Initial design is based
  * on 2 index types - 1) KNN in-memory using vector<> and priority_queue<>
  * 2) HNSW in-memory with persistence from hnswlib.
@@ -99,11 +121,37 @@ public:
     /* searchVectorNN - search and return 'n' Nearest Neighbours */
     virtual bool searchVectorNN(VectorPtr qvec, int dim,
                                 vector<KeyTypeInteger> & nnkeys,
-                                int n) = 0;
+                                int n,
+                                const VectorSearchParams & params = VectorSearchParams()) = 0;
+
+    /* searchVectorRange - search and return all neighbours within distance
+     * 'radius' of the query vector, nearest first, at most 'maxn' of them.
+     * Returns false if the index type does not support range search.
+     */
+    virtual bool searchVectorRange(VectorPtr /* qvec */, int /* dim */,
+                                   vector<KeyTypeInteger> & /* nnkeys */,
+                                   double /* radius */, int /* maxn */,
+                                   const VectorSearchParams & /* params */ = VectorSearchParams())
+        { return false; }
+
+    /* searchVectorDocs - multi-vector search on an index with docid=<col>.
+     * Return the 'ndocs' nearest document ids, the distance of a document
+     * is the distance of its nearest vector.
+     */
+    virtual bool searchVectorDocs(VectorPtr /* qvec */, int /* dim */,
+                                  vector<KeyTypeInteger> & /* docids */,
+                                  int /* ndocs */,
+                                  const VectorSearchParams & /* params */ = VectorSearchParams())
+        { return false; }
 
     /* insertVectortor - insert a vector into the index */
     virtual bool insertVector(VectorPtr vec, int dim, KeyTypeInteger id) = 0;
 
+    /* insertVectorDoc - insert a vector that is a chunk of document 'docid' */
+    virtual bool insertVectorDoc(VectorPtr vec, int dim, KeyTypeInteger id,
+                                 KeyTypeInteger /* docid */)
+        { return insertVector(vec, dim, id); }
+
     /* startParallelBuild - User has initiated parallel index build/rebuild */
     virtual bool startParallelBuild(int nthreads) = 0;
 
@@ -115,39 +163,108 @@ public:
 
     /* getRowCount - get number of vectors present in the index */
     virtual unsigned long getRowCount() = 0;
+
+    /* setBuildStats - rows inserted and seconds taken by the last build */
+    virtual void setBuildStats(unsigned long /* rows */, double /* secs */) {}
+
+    /* supportsResumableBuild - a build of the index can save its partial
+     * index with saveBuildState() and continue after loadBuildState().
+     */
+    virtual bool supportsResumableBuild() { return false; }
+
+    /* saveBuildState - save the partial index of a build, the base table
+     * rows up to key 'lastKey' are in the index, as of binlog position
+     * (binlogFile, binlogPos).
+     */
+    virtual bool saveBuildState(const string & /* path */, KeyTypeInteger /* lastKey */,
+                                const string & /* binlogFile */, size_t /* binlogPos */)
+        { return false; }
+
+    /* loadBuildState - load the partial index saved by saveBuildState() */
+    virtual bool loadBuildState(const string & /* path */, KeyTypeInteger & /* lastKey */,
+                                string & /* binlogFile */, size_t & /* binlogPos */)
+        { return false; }
+
+    /* dropBuildState - delete the partial index, the build is complete */
+    virtual void dropBuildState(const string & /* path */) {}
           
     virtual void getLastUpdateCoordinates(string & /* file */, size_t & /* pos */) {}
 
     virtual void setLastUpdateCoordinates(const string & /* file */, const size_t & /* pos */) {}
 
-    virtual void setSearchEffort(int ef_search) {} /* how much deep/wide to go? e.g ef_search in HNSW */
-
-    void lockShared()      { m_mutex.lock_shared(); }
-    void lockExclusive()   { m_mutex.lock(); }
+    /* setSearchEffort - default search effort of the index e.g ef_search in
+     * HNSW. Queries pass their own in VectorSearchParams.
+     */
+    virtual void setSearchEffort(int ef_search) {}
+
+    /* getPartitionColumn - column named in partition_by=<col>, or "" if the
+     * index is not partitioned.
+     */
+    virtual string getPartitionColumn() { return ""; }
+
+    /* getDocIdColumn - column named in docid=<col>, or "" if every row is
+     * a document by itself.
+     */
+    virtual string getDocIdColumn() { return ""; }
+
+    /* getPartition - sub-index holding the rows for one value of the
+     * partition column. If create is true, an empty sub-index is added
+     * when the value is seen for the first time.
+     */
+    virtual AbstractVectorIndex* getPartition(const string & /* value */,
+                                              bool /* create */ = false)
+        { return nullptr; }
+
+    /* insertVectorPartition - insert a row of an index with partition_by=<col>
+     * into the partition for 'value', 'docid' is used if the index has a
+     * docid=<col>. A key that is in another partition is deleted there, so
+     * an update of the partition column moves the row.
+     */
+    virtual bool insertVectorPartition(VectorPtr /* vec */, int /* dim */,
+                                       KeyTypeInteger /* id */,
+                                       KeyTypeInteger /* docid */,
+                                       const string & /* value */)
+        { return false; }
 
-    void unlockShared()    { m_mutex.unlock_shared(); }
-    void unlockExclusive() { m_mutex.unlock(); }
-
-    shared_mutex & mutex()  { return m_mutex; }
-private:
-    mutable shared_mutex m_mutex;
 };
 
+/* VectorIndexHandle - reference to an open index. The collection hands out
+ * handles, an index that is dropped or replaced by a new build/load stays
+ * valid for the queries and binlog updates holding a handle, and is closed
+ * and freed when the last handle is released.
+ */
+typedef shared_ptr<AbstractVectorIndex> VectorIndexHandle;
+
 class VectorIndexCollection
 {
 public:
-    AbstractVectorIndex* open(const string & name,
-                              const string & options,
-                              const string & useraction);
+    VectorIndexHandle open(const string & name,
+                           const string & options,
+                           const string & useraction);
+
+    /* create - new index of the type in options, not added to the
+     * collection. Used for shadow builds and loads.
+     */
+    static VectorIndexHandle create(const string & name,
+                                    const string & options);
+
+    VectorIndexHandle get(const string & name);
 
-    AbstractVectorIndex* get(const string & name);
+    /* replace - make hnew the index returned by get() for its name, if
+     * hold is still the open index of that name.
+     */
+    bool              replace(const VectorIndexHandle & hold,
+                              const VectorIndexHandle & hnew);
 
-    bool                 close(AbstractVectorIndex * hindex);
+    /* close - remove the index from the collection, if it is still the
+     * open index of its name.
+     */
+    bool              close(const VectorIndexHandle & hindex);
 
-    string               FindEarliestBinlogFile();
+    string            FindEarliestBinlogFile();
 
 private:
-    unordered_map<string, AbstractVectorIndex*> m_indexes;
+    unordered_map<string, VectorIndexHandle> m_indexes;
     mutex m_mutex;
 };
 
@@ -22,6 +22,7 @@
 */
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -35,6 +36,12 @@
 #include <regex>
 #include <condition_variable>
 #include <fstream>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 
 // #include <boost/lockfree/queue.hpp>
 #include "mysql_version.h"  // MYSQL_VERSION_ID
@@ -72,14 +79,20 @@ static void usleep(int usec) { ::Sleep(usec / 1000); }
 #include "myvector.h"
 using namespace std;
 #include "myvectorutils.h"
+#include "mysql/plugin.h"
+#include "mysql/service_my_plugin_log.h"
 
 extern char *myvector_index_dir;
+extern MYSQL_PLUGIN gplugin;
+
+#define warning_print(...) my_plugin_log_message(&gplugin, MY_WARNING_LEVEL, __VA_ARGS__)
 
 /// Format_description_event glob_description_event(BINLOG_VERSION, server_version);
 
 void myvector_table_op(const string &dbname, const string &tbname, const string &cname,
                        unsigned int pkid, vector<unsigned char> &vec,
-                       const string &binlogfile, const size_t &pos);
+                       const string &binlogfile, const size_t &pos,
+                       const string &partition, KeyTypeInteger docid);
 string myvector_find_earliest_binlog_file();
 
 typedef struct
@@ -92,6 +105,8 @@ typedef struct
   unsigned int          pkid_;
   string                binlogFile_;
   size_t                binlogPos_;
+  string                partition_; // value of partition_by column
+  KeyTypeInteger        docid_;     // value of docid column
 } VectorIndexUpdateItem;
 
 typedef struct
@@ -99,6 +114,9 @@ typedef struct
   string                vectorColumn;
   int                   idColumnPosition;
   int                   vecColumnPosition;
+  int                   partColumnPosition; // 0 if not partitioned
+  int                   docColumnPosition;  // 0 if no docid column
+  bool                  partColumnUnsigned; // partition column is "unsigned"
 } VectorIndexColumnInfo;
 
 // boost::lockfree::queue<VectorIndexUpdateItem*> gqueue(128); /* FUTURE */
@@ -236,9 +254,36 @@ void parseTableMapEvent(const unsigned char * event_buf, unsigned int event_len,
     return;
 }
 
+/* RowIntegerLength() - bytes of an integer column value in a row event,
+ * 0 if the type is not an integer type.
+ */
+static int RowIntegerLength(unsigned char type) {
+  switch (type) {
+    case MYSQL_TYPE_TINY:     return 1;
+    case MYSQL_TYPE_SHORT:    return 2;
+    case MYSQL_TYPE_INT24:    return 3;
+    case MYSQL_TYPE_LONG:     return 4;
+    case MYSQL_TYPE_LONGLONG: return 8;
+    default:                  return 0;
+  }
+}
+
+/* RowIntegerText() - an integer column value of a row event in the text form
+ * the server returns for it, so that the partition value of a row from the
+ * binlog is the same as from the SELECT of the index build.
+ */
+static string RowIntegerText(const unsigned char *val, int len, bool isUnsigned) {
+  unsigned long long uval = 0;
+  memcpy(&uval, val, len); /// little endian
+  if (isUnsigned)
+    return to_string(uval);
+  int shift = 64 - (len * 8);
+  return to_string((long long)(uval << shift) >> shift);
+}
+
 void parseRowsEvent(const unsigned char *event_buf, unsigned int event_len,
                     TableMapEvent &tev, unsigned int pos1, unsigned int pos2,
-                    vector<VectorIndexUpdateItem *> &updates)
+                    int pos3, int pos4, vector<VectorIndexUpdateItem *> &updates)
 {
   int index = EVENT_HEADER_LENGTH;
 
@@ -259,28 +304,63 @@ void parseRowsEvent(const unsigned char *event_buf, unsigned int event_len,
   
   unsigned int ncols = (unsigned int)event_buf[index];
   index++;
+  // TODO : Assuming all columns are included (binlog_row_image=FULL)
   unsigned int inclen = (((unsigned int)(ncols) + 7) >> 3);
-  // TODO : Assuming included & null bitmaps are single byte
-  unsigned int incbitmap = (unsigned int)event_buf[index];
-  index++;
+  index += inclen; // included columns bitmap
+
+  string key = tev.dbName + "." + tev.tableName;
+  bool partUnsigned = g_OnlineVectorIndexes[key].partColumnUnsigned;
+
   while (true) {
-  unsigned int nullbitmap = (unsigned int)event_buf[index];
-  index++;
+  const unsigned char *nullbitmap = &event_buf[index];
+  index += inclen;
 
-  unsigned int  lval = 0;
-  unsigned long llval = 0;
+  unsigned long long llval = 0;
 
   unsigned int idVal = 0, vecsz = 0;
   const unsigned char *vec = nullptr;
+  string partVal; /// NULL is "", as in the build
+  KeyTypeInteger docVal = 0;
   for (int i = 0; i  < ncols; i++) {
+    if (nullbitmap[i >> 3] & (1 << (i & 7)))
+      continue; /// NULL, no value in the row image
     switch (tev.columnTypes[i]) {
+      case MYSQL_TYPE_TINY:
+      case MYSQL_TYPE_SHORT:
+      case MYSQL_TYPE_INT24:
       case MYSQL_TYPE_LONG:
-               memcpy(&lval, &event_buf[index], 4); index+=4;
-               if (i == pos1) idVal = lval;
+      case MYSQL_TYPE_LONGLONG: {
+               int len = RowIntegerLength(tev.columnTypes[i]);
+               llval = 0;
+               memcpy(&llval, &event_buf[index], len);
+               if (i == pos1) idVal = llval;
+               if (i == pos3) partVal = RowIntegerText(&event_buf[index], len, partUnsigned);
+               if (i == pos4) docVal = llval;
+               index += len;
                break;
-      case MYSQL_TYPE_LONGLONG:
-               memcpy(&llval, &event_buf[index], 8); index+=8;
+               }
+      case MYSQL_TYPE_STRING: {
+               /* metadata is the real type (CHAR, ENUM, SET) and the length */
+               unsigned int realtype = tev.columnMetadata[i] & 0xFF;
+               unsigned int maxlen   = (tev.columnMetadata[i] >> 8) & 0xFF;
+               if (realtype == MYSQL_TYPE_ENUM || realtype == MYSQL_TYPE_SET) {
+                 index += maxlen; /// packed value of 1 or 2 (ENUM), 1-8 (SET) bytes
+                 break;
+               }
+               if ((realtype & 0x30) != 0x30)
+                 maxlen |= (((realtype & 0x30) ^ 0x30) << 4);
+               unsigned int clen = 0;
+               if (maxlen < 256) {
+                  clen = (unsigned int)event_buf[index]; index++;
+               }
+               else {
+                  memcpy(&clen, &event_buf[index], 2); index+=2;
+               }
+               if (i == pos3) // trailing spaces are not in the row, as in the server text
+                 partVal.assign((const char *)&event_buf[index], clen);
+               index += clen;
                break;
+               }
       case MYSQL_TYPE_VARCHAR: {
                unsigned int clen = 0;
                if (tev.columnMetadata[i] < 256) {
@@ -293,6 +373,8 @@ void parseRowsEvent(const unsigned char *event_buf, unsigned int event_len,
                  vec = &event_buf[index];
                  vecsz = clen;
                }
+               if (i == pos3) // found partition column
+                 partVal.assign((const char *)&event_buf[index], clen);
                index += clen;
                break;
                }
@@ -317,8 +399,11 @@ void parseRowsEvent(const unsigned char *event_buf, unsigned int event_len,
     } // switch
   } // for columns
 
+  /* NULL doc id - the row is a document by itself, as in the build */
+  if (pos4 >= 0 && (nullbitmap[pos4 >> 3] & (1 << (pos4 & 7))))
+    docVal = idVal;
+
   VectorIndexUpdateItem *item = new VectorIndexUpdateItem();
-  string key = tev.dbName + "." + tev.tableName;
   string columnName = g_OnlineVectorIndexes[key].vectorColumn;
   item->dbName_    = tev.dbName;
   item->tableName_ = tev.tableName;
@@ -327,6 +412,8 @@ void parseRowsEvent(const unsigned char *event_buf, unsigned int event_len,
   item->pkid_       = idVal;
   item->binlogFile_ = currentBinlogFile;
   item->binlogPos_  = currentBinlogPos;
+  item->partition_  = partVal;
+  item->docid_      = docVal;
   updates.push_back(item);
   //index += 4;
   if (index >= event_len) break; // done - multi rows
@@ -444,6 +531,67 @@ void GetBaseTableColumnPositions(MYSQL *hnd, const char *db, const char *table,
   return;
 }
 
+/* GetBaseTableColumnPosition() - Get the column ordinal position of a single
+ * column e.g the partition_by column of a partitioned vector index. Returns
+ * 0 if the column is not found. The column type e.g "int unsigned" or
+ * "varchar(32)" is returned in coltype, if not null.
+ */
+int GetBaseTableColumnPosition(MYSQL *hnd, const char *db, const char *table,
+                               const char *col, string *coltype = nullptr) {
+  static const char *q = "select ordinal_position, column_type from "
+                         "information_schema.columns where table_schema='%s' "
+                         "and table_name='%s' and column_name='%s';";
+  char buff[MYVECTOR_BUFF_SIZE];
+  int  colpos = 0;
+
+  snprintf(buff, sizeof(buff), q, db, table, col);
+
+  if (mysql_real_query(hnd, buff, strlen(buff)))
+    return 0;
+
+  MYSQL_RES *result = mysql_store_result(hnd);
+  if (!result)
+    return 0;
+
+  MYSQL_ROW row;
+  if ((row = mysql_fetch_row(result)) && row[0]) {
+    colpos = atoi(row[0]);
+    if (coltype && row[1])
+      *coltype = row[1];
+  }
+
+  mysql_free_result(result);
+
+  return colpos;
+}
+
+/* IsDocIdColumnType() - docid=<col> has to be an integer column, the doc
+ * id of a row is decoded from the binlog row events as an integer.
+ */
+static bool IsDocIdColumnType(const string &coltype) {
+  static const char *types[] = {"tinyint", "smallint", "mediumint", "int",
+                                "bigint"};
+  string basetype = coltype.substr(0, coltype.find_first_of("( "));
+  for (auto type : types)
+    if (basetype == type)
+      return true;
+  return false;
+}
+
+/* IsPartitionColumnType() - partition_by=<col> has to be an integer, CHAR or
+ * VARCHAR column, these are decoded from the binlog row events.
+ */
+static bool IsPartitionColumnType(const string &coltype, bool &isUnsigned) {
+  static const char *types[] = {"tinyint", "smallint", "mediumint", "int",
+                                "bigint", "char", "varchar"};
+  string basetype = coltype.substr(0, coltype.find_first_of("( "));
+  isUnsigned = (coltype.find("unsigned") != string::npos);
+  for (auto type : types)
+    if (basetype == type)
+      return true;
+  return false;
+}
+
 void myvector_open_index_impl(char *vecid, char *details, char *pkidcol,
              char *action, char *extra, char *result);
 
@@ -501,6 +649,25 @@ void OpenAllOnlineVectorIndexes(MYSQL *hnd) {
     if (idcolpos == 0 || veccolpos == 0)
       continue;
 
+    int partcolpos = 0;
+    bool partunsigned = false;
+    string partcol = vo.getOption("partition_by");
+    if (partcol.length()) {
+      string coltype;
+      partcolpos = GetBaseTableColumnPosition(hnd, dbname, tbl, partcol.c_str(), &coltype);
+      if (partcolpos == 0 || !IsPartitionColumnType(coltype, partunsigned))
+        continue;
+    }
+
+    int doccolpos = 0;
+    string doccol = vo.getOption("docid");
+    if (doccol.length()) {
+      string coltype;
+      doccolpos = GetBaseTableColumnPosition(hnd, dbname, tbl, doccol.c_str(), &coltype);
+      if (doccolpos == 0 || !IsDocIdColumnType(coltype))
+        continue;
+    }
+
     if (online == "y" || online == "Y") {
       char empty[1024];
       char action[] = "load";
@@ -509,7 +676,8 @@ void OpenAllOnlineVectorIndexes(MYSQL *hnd) {
       myvector_open_index_impl(vecid, info, empty, action, empty, empty);
 
       sprintf(vecid, "%s.%s", dbname, tbl);
-      VectorIndexColumnInfo vc{col, idcolpos, veccolpos};
+      VectorIndexColumnInfo vc{col, idcolpos, veccolpos, partcolpos, doccolpos,
+                               partunsigned};
       g_OnlineVectorIndexes[vecid] = vc;
     }
   } // while
@@ -517,136 +685,915 @@ void OpenAllOnlineVectorIndexes(MYSQL *hnd) {
   mysql_free_result(result);
 }
 
+bool myvector_replace_index(const VectorIndexHandle &oldvi, const VectorIndexHandle &newvi);
+
+/* Parallel build - the base table is scanned in (threads x ..._PER_THREAD)
+ * primary key ranges, so that a skewed range does not leave threads idle.
+ * Scan threads stream rows in batches into a queue of at most
+ * (threads x ..._PER_THREAD) batches, worker threads insert them.
+ */
+static const int    MYVECTOR_BUILD_RANGES_PER_THREAD  = 4;
+static const size_t MYVECTOR_BUILD_BATCH_ROWS         = 1024;
+static const size_t MYVECTOR_BUILD_BATCHES_PER_THREAD = 4;
+
+/* BuildRowBatch - base table rows fetched for the index build */
+struct BuildRowBatch
+{
+  vector<KeyTypeInteger> ids;
+  vector<KeyTypeInteger> docids;     /// docid=<col> index only
+  vector<string>         partitions; /// partition_by=<col> index only
+  vector<size_t>         offsets;    /// vector of row i is at data[offsets[i]]
+  vector<char>           data;
+
+  size_t size() const { return ids.size(); }
+
+  /* add - add a row fetched with columns <id, vector [, part] [, docid]> */
+  void add(MYSQL_ROW row, unsigned long *lengths, int partidx, int docidx) {
+    KeyTypeInteger id = atol(row[0]);
+    ids.push_back(id);
+    if (docidx) /// NULL doc id, the row is a document by itself
+      docids.push_back(row[docidx] ? atol(row[docidx]) : id);
+    if (partidx) /// NULL partition values go to partition ""
+      partitions.push_back(row[partidx] ? string(row[partidx], lengths[partidx]) : "");
+    offsets.push_back(data.size());
+    data.insert(data.end(), row[1], row[1] + lengths[1]);
+  }
+};
+
+/* InsertBuildRows - insert a batch of rows into the index, returns the
+ * number of rows inserted.
+ */
+static size_t InsertBuildRows(AbstractVectorIndex *vi, BuildRowBatch &batch) {
+  for (size_t i = 0; i < batch.size(); i++) {
+    char *vec = &batch.data[batch.offsets[i]];
+    if (batch.partitions.size())
+      vi->insertVectorPartition(vec, 0, batch.ids[i],
+                                (batch.docids.size() ? batch.docids[i] : batch.ids[i]),
+                                batch.partitions[i]);
+    else if (batch.docids.size())
+      vi->insertVectorDoc(vec, 0, batch.ids[i], batch.docids[i]);
+    else
+      vi->insertVector(vec, 0, batch.ids[i]); /// dim is already known by vi
+  }
+  return batch.size();
+}
+
+/* ConnectBuildSession - new connection to read the base table for a build.
+ * A snapshot session reads the table in a consistent snapshot that is taken
+ * here, the caller has the table locked so that no DML is in flight.
+ */
+static bool ConnectBuildSession(MYSQL *mysql, bool snapshot, char *errorbuf) {
+  mysql_init(mysql);
+
+  if (!mysql_real_connect(mysql, myvector_conn_host.c_str(), myvector_conn_user_id.c_str(), myvector_conn_password.c_str(),
+                          NULL, (myvector_conn_port.length() ? atoi(myvector_conn_port.c_str()) : 0), myvector_conn_socket.c_str(),
+                          CLIENT_IGNORE_SIGPIPE))
+  {
+    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in new connection to build vector index : %s.",
+             mysql_error(mysql));
+    return false;
+  }
+
+  (void) mysql_autocommit(mysql, false);
+
+  const char *q[] = { "SET TRANSACTION ISOLATION LEVEL READ COMMITTED", nullptr };
+  if (snapshot) {
+    q[0] = "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ";
+    q[1] = "START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY";
+  }
+  for (int i = 0; i < 2 && q[i]; i++) {
+    if (mysql_real_query(mysql, q[i], strlen(q[i]))) {
+      snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in build session setup : %s.",
+               mysql_error(mysql));
+      mysql_close(mysql);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* OpenBuildSessions - 'n' connections to scan the base table */
+static bool OpenBuildSessions(MYSQL *conns, int n, bool snapshot, char *errorbuf) {
+  for (int i = 0; i < n; i++) {
+    if (!ConnectBuildSession(&conns[i], snapshot, errorbuf)) {
+      while (i--)
+        mysql_close(&conns[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void CloseBuildSessions(MYSQL *conns, int n) {
+  for (int i = 0; i < n; i++)
+    mysql_close(&conns[i]);
+}
+
+/* GetBinlogPosition - current binlog file & position of the server */
+static bool GetBinlogPosition(MYSQL *mysql, string &binlogFile, size_t &binlogPos,
+                              char *errorbuf) {
+#if MYSQL_VERSION_ID >= 80200
+  const char *q = "SHOW BINARY LOG STATUS";
+#else
+  const char *q = "SHOW MASTER STATUS";
+#endif
+  MYSQL_RES *result = nullptr;
+  MYSQL_ROW  row    = nullptr;
+  if (mysql_real_query(mysql, q, strlen(q)) ||
+      !(result = mysql_store_result(mysql)) ||
+      !(row = mysql_fetch_row(result)) || !row[0] || !row[1]) {
+    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in reading binlog position : %s.",
+             (mysql_errno(mysql) ? mysql_error(mysql) : "binlog is disabled"));
+    if (result) mysql_free_result(result);
+    return false;
+  }
+  binlogFile = row[0];
+  binlogPos  = strtoull(row[1], nullptr, 10);
+  mysql_free_result(result);
+  return true;
+}
+
+/* TableChangedSince - true if the binlog after (binlogFile, binlogPos) has
+ * row events of db.table, or statements that name the table e.g DDL. Also
+ * true if the binlog cannot be read from there e.g the file was purged.
+ */
+static bool TableChangedSince(MYSQL *mysql, const char *db, const char *table,
+                              const string &binlogFile, size_t binlogPos) {
+  const char *q = "SHOW BINARY LOGS";
+  MYSQL_RES *result = nullptr;
+  MYSQL_ROW  row    = nullptr;
+  if (mysql_real_query(mysql, q, strlen(q)) || !(result = mysql_store_result(mysql)))
+    return true;
+
+  vector<string> files; /// binlogFile and the files after it
+  while ((row = mysql_fetch_row(result))) {
+    if (row[0] && (files.size() || binlogFile == row[0]))
+      files.push_back(row[0]);
+  }
+  mysql_free_result(result);
+  if (files.empty())
+    return true;
+
+  string tablemap = "(" + string(db) + "." + string(table) + ")";
+  for (auto &file : files) {
+    string sq = "SHOW BINLOG EVENTS IN '" + file + "'";
+    if (file == binlogFile)
+      sq += " FROM " + to_string(binlogPos);
+    if (mysql_real_query(mysql, sq.c_str(), sq.length()) ||
+        !(result = mysql_use_result(mysql)))
+      return true;
+
+    /// Log_name, Pos, Event_type, Server_id, End_log_pos, Info
+    bool changed = false;
+    while ((row = mysql_fetch_row(result))) {
+      if (changed || !row[2] || !row[5])
+        continue; /// all rows are read before the next query
+      if ((!strcmp(row[2], "Table_map") && strstr(row[5], tablemap.c_str())) ||
+          (!strcmp(row[2], "Query") && strstr(row[5], table)))
+        changed = true;
+    }
+    mysql_free_result(result);
+    if (changed)
+      return true;
+  }
+  return false;
+}
+
+/* GetKeyRange - MIN and MAX of the integer primary key 'idcol' over the
+ * rows of 'query' + 'where'. 'empty' is set if there are no rows.
+ */
+static bool GetKeyRange(MYSQL *mysql, const string &query, const string &where,
+                        const char *idcol, long long &minid, long long &maxid,
+                        bool &empty, char *errorbuf) {
+  string q = "SELECT MIN(" + string(idcol) + "), MAX(" + string(idcol) + ")" +
+             query.substr(query.find(" FROM ")) + where;
+  if (mysql_real_query(mysql, q.c_str(), q.length())) {
+    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in reading key range : %s.",
+             mysql_error(mysql));
+    return false;
+  }
+  MYSQL_RES *result = mysql_store_result(mysql);
+  MYSQL_ROW  row    = (result ? mysql_fetch_row(result) : nullptr);
+  empty = (!row || !row[0] || !row[1]);
+  if (!empty) {
+    minid = atoll(row[0]);
+    maxid = atoll(row[1]);
+  }
+  if (result) mysql_free_result(result);
+  return true;
+}
+
+/* KeyRangeWidth - width of each of 'n' ranges splitting the keys 'minid' to
+ * 'maxid', 'n' is clamped to 1 .. number of keys. The span of the keys is
+ * unsigned, the full long long range has 2^64 keys, so the width saturates.
+ */
+static unsigned long long KeyRangeWidth(long long minid, long long maxid,
+                                        unsigned long long &n) {
+  unsigned long long span = (unsigned long long)maxid - (unsigned long long)minid;
+  if (n == 0)
+    n = 1;
+  if (span < n - 1) /// n > span + 1, without span + 1 wrapping to 0
+    n = span + 1;
+  unsigned long long width = span / n;
+  return (width == ULLONG_MAX ? width : width + 1);
+}
+
+/* KeyRangeBounds - keys 'lo' to 'hi' of range 'r' of the 'n' ranges of
+ * KeyRangeWidth(). Offsets from 'minid' are unsigned and 'hi' saturates at
+ * 'maxid'. False if the range starts past 'maxid' i.e it has no keys.
+ */
+static bool KeyRangeBounds(long long minid, long long maxid, unsigned long long width,
+                           unsigned long long r, unsigned long long n,
+                           long long &lo, long long &hi) {
+  unsigned long long span = (unsigned long long)maxid - (unsigned long long)minid;
+  if (r > span / width) /// r * width > span
+    return false;
+  unsigned long long off = r * width;
+  lo = (long long)((unsigned long long)minid + off);
+  hi = (r == n - 1 || width - 1 >= span - off)
+           ? maxid
+           : (long long)((unsigned long long)minid + off + (width - 1));
+  return true;
+}
+
+/* ScanBaseTableParallel - fetch the rows of 'query' with keys from 'minid'
+ * to 'maxid' over the 'nthreads' connections 'conns', one primary key range
+ * at a time, and insert them from 'nthreads' worker threads. The rows are
+ * streamed (mysql_use_result), at most a few batches per thread are held in
+ * memory. The base table is locked by the caller, or the connections share
+ * a consistent snapshot, so all the connections read the same rows.
+ */
+static bool ScanBaseTableParallel(MYSQL *conns, const VectorIndexHandle &vi,
+                                  const string &query, const string &where,
+                                  const char *idcol, long long minid, long long maxid,
+                                  int partidx, int docidx,
+                                  int nthreads, size_t &nRows, char *errorbuf) {
+  unsigned long long ranges = (unsigned long long)max(nthreads, 1) *
+                              MYVECTOR_BUILD_RANGES_PER_THREAD;
+  unsigned long long width  = KeyRangeWidth(minid, maxid, ranges);
+
+  BoundedQueue<BuildRowBatch> queue(nthreads * MYVECTOR_BUILD_BATCHES_PER_THREAD);
+  atomic<unsigned long long>  nextRange{0};
+  atomic<size_t>              inserted{0};
+  atomic<bool>                failed{false};
+  mutex                       errorMutex;
+
+  auto scan = [&](MYSQL *conn) {
+    unsigned long long r;
+    while (!failed && (r = nextRange++) < ranges) {
+      long long lo, hi;
+      if (!KeyRangeBounds(minid, maxid, width, r, ranges, lo, hi))
+        continue;
+      string rq = query + (where.length() ? where + " AND " : string(" WHERE ")) +
+                  string(idcol) + " BETWEEN " + to_string(lo) + " AND " + to_string(hi);
+
+      MYSQL_RES *res = nullptr;
+      if (mysql_real_query(conn, rq.c_str(), rq.length()) ||
+          !(res = mysql_use_result(conn))) {
+        lock_guard<mutex> l(errorMutex);
+        if (!failed.exchange(true))
+          snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in reading base table : %s.",
+                   mysql_error(conn));
+        queue.close();
+        break;
+      }
+
+      BuildRowBatch batch;
+      MYSQL_ROW     srow;
+      while ((srow = mysql_fetch_row(res))) {
+        unsigned long *lengths = mysql_fetch_lengths(res);
+        if (!srow[0] || !srow[1])
+          continue;
+        batch.add(srow, lengths, partidx, docidx);
+        if (batch.size() == MYVECTOR_BUILD_BATCH_ROWS) {
+          if (!queue.push(std::move(batch)))
+            break; /// another thread failed
+          batch = BuildRowBatch();
+        }
+      }
+      if (batch.size())
+        queue.push(std::move(batch));
+      mysql_free_result(res);
+    }
+  };
+
+  auto work = [&]() {
+    BuildRowBatch batch;
+    try {
+      while (queue.pop(batch))
+        inserted += InsertBuildRows(vi.get(), batch);
+    } catch (std::exception &e) { /// e.g index is full
+      lock_guard<mutex> l(errorMutex);
+      if (!failed.exchange(true))
+        snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in inserting into index : %s.",
+                 e.what());
+      queue.close();
+    }
+  };
+
+  /* Inserts run in the shared worker pool. Scans wait on the server and on
+   * the queue, they have threads of their own.
+   */
+  WorkerPool &pool = myvector_worker_pool();
+  pool.reserve(nthreads);
+
+  vector<future<void>> workers;
+  vector<thread>       scanners;
+  for (int i = 0; i < nthreads; i++) {
+    workers.push_back(pool.submit(work));
+    scanners.emplace_back(scan, &conns[i]);
+  }
+  for (auto &t : scanners)
+    t.join();
+  queue.close(); /// workers exit when the queue is empty
+  for (auto &w : workers)
+    w.wait();
+
+  nRows += inserted;
+  return !failed;
+}
+
+bool isAfter(const string &binlogfile2, const size_t binlogpos2,
+             const string &binlogfile1, const size_t binlogpos1);
+
+/* Snapshot build (build=snapshot) - the base table is scanned in a
+ * consistent snapshot instead of under LOCK TABLES READ, so that DML goes on
+ * during the build. Binlog events of the table after the snapshot position
+ * are held in a SnapshotBuild during the scan and applied to the new index
+ * when the scan is done. The last events are applied with 'm' held till the
+ * new index is the open index, so that every event gets to the new index,
+ * from here or from myvector_table_op().
+ */
+struct SnapshotBuild
+{
+  string                        binlogFile;     /// position of the snapshot
+  size_t                        binlogPos = 0;
+  bool                          shadow    = false; /// old index serves queries
+  mutex                         m;
+  list<VectorIndexUpdateItem *> items;          /// events after the snapshot
+  bool                          done      = false;
+};
+
+/* Catch up rounds end when at most these many events are held, these are
+ * applied with the binlog mutex held.
+ */
+static const size_t MYVECTOR_SNAPSHOT_CATCHUP_EVENTS = 1024;
+
+static mutex                                  g_SnapshotBuildsMutex;
+static map<string, shared_ptr<SnapshotBuild>> g_SnapshotBuilds; /// by db.table.column
+
+/* HoldSnapshotBuildEvent - called for a binlog event before it is applied to
+ * the open index. Returns true if the event was taken by a snapshot build,
+ * i.e the open index is the index being built and must not get events
+ * before the scanned rows.
+ */
+static bool HoldSnapshotBuildEvent(VectorIndexUpdateItem *item) {
+  shared_ptr<SnapshotBuild> sb;
+  {
+    lock_guard<mutex> l(g_SnapshotBuildsMutex);
+    if (g_SnapshotBuilds.empty())
+      return false;
+    auto it = g_SnapshotBuilds.find(item->dbName_ + "." + item->tableName_ + "." +
+                                    item->columnName_);
+    if (it == g_SnapshotBuilds.end())
+      return false;
+    sb = it->second;
+  }
+
+  lock_guard<mutex> l(sb->m);
+  if (sb->done)
+    return false;
+
+  bool after = isAfter(item->binlogFile_, item->binlogPos_, sb->binlogFile, sb->binlogPos);
+  if (sb->shadow) { /// the old index gets the event too
+    if (after)
+      sb->items.push_back(new VectorIndexUpdateItem(*item));
+    return false;
+  }
+  if (after)
+    sb->items.push_back(item);
+  else
+    delete item; /// row is in the snapshot
+  return true;
+}
+
+/* ApplySnapshotBuildEvents - apply held events to vi like myvector_table_op()
+ * does and free them. Returns the number of events applied.
+ */
+static size_t ApplySnapshotBuildEvents(AbstractVectorIndex *vi,
+                                       list<VectorIndexUpdateItem *> &items) {
+  size_t n = items.size();
+  for (auto item : items) {
+    if (vi->getPartitionColumn().length())
+      vi->insertVectorPartition(item->vec_.data(), vi->getDimension(), item->pkid_,
+                                item->docid_, item->partition_);
+    else if (vi->getDocIdColumn().length())
+      vi->insertVectorDoc(item->vec_.data(), vi->getDimension(), item->pkid_, item->docid_);
+    else
+      vi->insertVector(item->vec_.data(), vi->getDimension(), item->pkid_);
+    delete item;
+  }
+  items.clear();
+  return n;
+}
+
+/* CatchUpSnapshotBuild - apply held events till only a few are left */
+static size_t CatchUpSnapshotBuild(AbstractVectorIndex *vi, SnapshotBuild *sb) {
+  size_t n = 0;
+  while (1) {
+    list<VectorIndexUpdateItem *> items;
+    {
+      lock_guard<mutex> l(sb->m);
+      if (sb->items.size() <= MYVECTOR_SNAPSHOT_CATCHUP_EVENTS)
+        return n;
+      items.swap(sb->items);
+    }
+    n += ApplySnapshotBuildEvents(vi, items);
+  }
+}
+
+/* EndSnapshotBuild - binlog events go to the open index only from here on */
+static void EndSnapshotBuild(const string &vecid) {
+  shared_ptr<SnapshotBuild> sb;
+  {
+    lock_guard<mutex> l(g_SnapshotBuildsMutex);
+    auto it = g_SnapshotBuilds.find(vecid);
+    if (it == g_SnapshotBuilds.end())
+      return;
+    sb = it->second;
+    g_SnapshotBuilds.erase(it);
+  }
+  lock_guard<mutex> l(sb->m);
+  sb->done = true;
+  for (auto item : sb->items) /// build failed
+    delete item;
+  sb->items.clear();
+}
+
+/* RegisterOnlineVectorIndex - binlog row events of the table are parsed
+ * for the vector column from here on.
+ */
+static void RegisterOnlineVectorIndex(MYSQL *mysql, const char *db, const char *table,
+                                      const char *idcol, const char *veccol,
+                                      const string &partcol, const string &doccol) {
+  int idcolpos = 0, veccolpos = 0;
+  GetBaseTableColumnPositions(mysql, db, table, idcol, veccol,
+                              idcolpos, veccolpos);
+  int partcolpos = 0, doccolpos = 0;
+  bool partunsigned = false;
+  if (partcol.length()) {
+    string coltype;
+    partcolpos = GetBaseTableColumnPosition(mysql, db, table, partcol.c_str(), &coltype);
+    IsPartitionColumnType(coltype, partunsigned); /// type is checked by the build
+  }
+  if (doccol.length())
+    doccolpos = GetBaseTableColumnPosition(mysql, db, table, doccol.c_str());
+  VectorIndexColumnInfo vc{veccol, idcolpos, veccolpos, partcolpos, doccolpos,
+                           partunsigned};
+  g_OnlineVectorIndexes[string(db) + "." + string(table)] = vc;
+}
+
+/* ScanBaseTable - fetch the rows of 'query' and insert them in batches. The
+ * rows are streamed, not buffered in client memory.
+ */
+static bool ScanBaseTable(MYSQL *mysql, const VectorIndexHandle &vi,
+                          const string &query, int partidx, int docidx,
+                          size_t &nRows, char *errorbuf) {
+  MYSQL_RES *result = nullptr;
+  if (mysql_real_query(mysql, query.c_str(), query.length()) ||
+      !(result = mysql_use_result(mysql))) {
+    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in reading base table : %s.",
+             mysql_error(mysql));
+    return false;
+  }
+
+  BuildRowBatch batch;
+  MYSQL_ROW     row;
+  while ((row = mysql_fetch_row(result)))
+  {
+    unsigned long *lengths = mysql_fetch_lengths(result);
+    if (!row[0] || !row[1])
+      continue;
+    batch.add(row, lengths, partidx, docidx);
+    if (batch.size() == MYVECTOR_BUILD_BATCH_ROWS) {
+      nRows += InsertBuildRows(vi.get(), batch);
+      batch = BuildRowBatch();
+    }
+  }
+  nRows += InsertBuildRows(vi.get(), batch);
+
+  mysql_free_result(result);
+  return true;
+}
+
+/* Resumable build - the base table is scanned in primary key segments of
+ * about MYVECTOR_BUILD_SEGMENT_ROWS rows. After a segment, if the last
+ * partial save is older than MYVECTOR_BUILD_STATE_SECS, the index is saved
+ * with the last key of the segment (saveBuildState()). A build that failed
+ * e.g on a server restart, is continued with the 'resume' action from the
+ * rows after that key.
+ */
+static const size_t MYVECTOR_BUILD_SEGMENT_ROWS = 1000000;
+static const int    MYVECTOR_BUILD_STATE_SECS   = 600;
+
+/* GetTableRowsEstimate - row count of the table from the data dictionary,
+ * 0 if not known.
+ */
+static size_t GetTableRowsEstimate(MYSQL *mysql, const char *db, const char *table) {
+  char query[MYVECTOR_BUFF_SIZE];
+  snprintf(query, sizeof(query), "SELECT TABLE_ROWS FROM information_schema.TABLES"
+           " WHERE TABLE_SCHEMA = '%s' AND TABLE_NAME = '%s'", db, table);
+
+  size_t     rows   = 0;
+  MYSQL_RES *result = nullptr;
+  MYSQL_ROW  row    = nullptr;
+  if (!mysql_real_query(mysql, query, strlen(query)) &&
+      (result = mysql_store_result(mysql)) &&
+      (row = mysql_fetch_row(result)) && row[0])
+    rows = strtoull(row[0], nullptr, 10);
+  if (result) mysql_free_result(result);
+  return rows;
+}
+
+/* BuildProgress - index builds in progress, for the 'status' action */
+struct BuildProgress
+{
+  VectorIndexHandle                  vi;
+  unsigned long                      startRows;  /// rows in vi at start e.g resume
+  size_t                             totalRows;  /// estimate
+  chrono::steady_clock::time_point   startTime;
+  unsigned long                      failedSaves{0}; /// saveBuildState() errors
+};
+
+static mutex                     g_BuildProgressMutex;
+static map<string, BuildProgress> g_BuildProgress; /// by db.table.column
+
+/* BuildProgressGuard - registers the build for myvector_build_progress()
+ * till the end of the scope.
+ */
+class BuildProgressGuard {
+public:
+  BuildProgressGuard(const string &vecid, const VectorIndexHandle &vi,
+                     size_t totalRows) : m_vecid(vecid) {
+    lock_guard<mutex> l(g_BuildProgressMutex);
+    g_BuildProgress[m_vecid] = BuildProgress{vi, vi->getRowCount(), totalRows,
+                                             chrono::steady_clock::now()};
+  }
+  ~BuildProgressGuard() {
+    lock_guard<mutex> l(g_BuildProgressMutex);
+    g_BuildProgress.erase(m_vecid);
+  }
+  /* saveFailed - a partial save failed, returns the failures so far */
+  unsigned long saveFailed() {
+    lock_guard<mutex> l(g_BuildProgressMutex);
+    return ++g_BuildProgress[m_vecid].failedSaves;
+  }
+private:
+  string m_vecid;
+};
+
+/* myvector_build_progress - status line of the build of vector index
+ * 'vecid' (db.table.column), "" if it is not being built.
+ */
+string myvector_build_progress(const string &vecid) {
+  lock_guard<mutex> l(g_BuildProgressMutex);
+  auto it = g_BuildProgress.find(vecid);
+  if (it == g_BuildProgress.end())
+    return "";
+
+  BuildProgress &bp   = it->second;
+  unsigned long  rows = bp.vi->getRowCount();
+  double         secs = chrono::duration<double>(chrono::steady_clock::now() -
+                                                 bp.startTime).count();
+  unsigned long  rate = (secs > 0 ? (unsigned long)((rows - bp.startRows) / secs) : 0);
+
+  stringstream ss;
+  ss << "Build Progress : " << rows << " of ~" << bp.totalRows << " rows, "
+     << rate << " rows/sec";
+  if (rate && bp.totalRows > rows)
+    ss << ", ETA " << (bp.totalRows - rows) / rate << " secs";
+  if (bp.failedSaves)
+    ss << ", partial saves failed : " << bp.failedSaves;
+  ss << endl;
+  return ss.str();
+}
+
 /* BuildMyVectorIndexSQL - Build/Refresh the Vector Index! This function uses
  * SQL to fetch rows from the base table and put the ID & vector into the
- * vector index.
+ * vector index. For a shadow build, 'replaces' is the open index that keeps
+ * serving queries during the build, it is replaced by vi after vi is saved.
+ * With nthreads >= 2 and an index that takes concurrent inserts, the table
+ * is read and inserted in parallel (ScanBaseTableParallel()).
+ * The table is locked (LOCK TABLES READ) for the whole build, or with
+ * 'snapshot' only till the scan sessions have taken a consistent snapshot
+ * (see SnapshotBuild). A build of an index that supportsResumableBuild()
+ * saves partial builds as it goes, bo.resume continues one from the rows
+ * after bo.resumeKey.
+ * Returns false if vi was not built, or was not made the open index.
  */
-void BuildMyVectorIndexSQL(const char *db, const char *table, const char *idcol,
+bool BuildMyVectorIndexSQL(const char *db, const char *table, const char *idcol,
                            const char *veccol, const char *action,
                            const char *trackingColumn,
-                           AbstractVectorIndex *vi,
+                           const VectorIndexHandle &vi,
+                           const VectorIndexHandle &replaces,
+                           const MyVectorBuildOptions &bo,
                            char *errorbuf) {
 
   strcpy(errorbuf, "SUCCESS");
-  size_t nRows = 0;
+  size_t nRows = 0, nEvents = 0;
+  int    nthreads = bo.nthreads;
+  bool   snapshot = bo.snapshot;
 
-  fprintf(stderr, "BuildMyVectorIndexSQL %s %s %s %s %s %s.\n",
-          db, table, idcol, veccol,  action, trackingColumn);
+  fprintf(stderr, "BuildMyVectorIndexSQL %s %s %s %s %s %s%s.\n",
+          db, table, idcol, veccol,  action, trackingColumn,
+          (snapshot ? " (snapshot)" : ""));
+
+  if (snapshot && !vi->supportsIncrUpdates()) {
+    strcpy(errorbuf, "Snapshot build needs an online vector index (online=Y).");
+    return false;
+  }
 
   MYSQL mysql;
 
   /* Use a new connection for vector index */
-  mysql_init(&mysql);
+  if (!ConnectBuildSession(&mysql, false, errorbuf))
+    return false;
 
-  if (!mysql_real_connect(&mysql, myvector_conn_host.c_str(), myvector_conn_user_id.c_str(), myvector_conn_password.c_str(),
-                          NULL, (myvector_conn_port.length() ? atoi(myvector_conn_port.c_str()) : 0), myvector_conn_socket.c_str(),
-                          CLIENT_IGNORE_SIGPIPE))
-  {
-    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in new connection to build vector index : %s.",
-             mysql_error(&mysql));
-    return;
-  }
+  char query[MYVECTOR_BUFF_SIZE];
 
-  (void) mysql_autocommit(&mysql, false);
+  sprintf(query, "LOCK TABLES %s.%s READ", db, table); // No DMLs during build, or till snapshot.
 
-  char query[MYVECTOR_BUFF_SIZE];
-    
-  sprintf(query, "SET TRANSACTION ISOLATION LEVEL READ COMMITTED");
   if (mysql_real_query(&mysql, query, strlen(query))) {
     //TODO
-    return;
+    return false;
   }
 
-  sprintf(query, "LOCK TABLES %s.%s READ", db, table); // No DMLs during build.
+  /* Partitioned index - next column routes the row to its partition.
+   * Multi-vector index - next column is the doc id of the row.
+   */
+  string partcol = vi->getPartitionColumn();
+  string doccol  = vi->getDocIdColumn();
+  if (partcol.length()) {
+    string coltype;
+    bool   partunsigned = false;
+    if (!GetBaseTableColumnPosition(&mysql, db, table, partcol.c_str(), &coltype) ||
+        !IsPartitionColumnType(coltype, partunsigned)) {
+      snprintf(errorbuf, MYVECTOR_BUFF_SIZE,
+               "partition_by column %s has to be an integer, CHAR or VARCHAR column.",
+               partcol.c_str());
+      mysql_close(&mysql);
+      return false;
+    }
+  }
+  if (doccol.length()) {
+    string coltype;
+    if (!GetBaseTableColumnPosition(&mysql, db, table, doccol.c_str(), &coltype) ||
+        !IsDocIdColumnType(coltype)) {
+      snprintf(errorbuf, MYVECTOR_BUFF_SIZE,
+               "docid column %s has to be an integer column.", doccol.c_str());
+      mysql_close(&mysql);
+      return false;
+    }
+  }
 
-  if (mysql_real_query(&mysql, query, strlen(query))) {
-    //TODO
-    return;
+  /* Resume - the partial build has the rows as of its binlog position. The
+   * scan after resumeKey would miss DML on the rows before it since then.
+   */
+  if (bo.resume && (bo.resumeBinlogFile.empty() ||
+                    TableChangedSince(&mysql, db, table, bo.resumeBinlogFile,
+                                      bo.resumeBinlogPos))) {
+    snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Table %s.%s may have changed since the "
+             "partial build was saved (%s %lu), it cannot be resumed. Run a build.",
+             db, table, bo.resumeBinlogFile.c_str(), bo.resumeBinlogPos);
+    mysql_close(&mysql);
+    return false;
   }
 
-  sprintf(query, "SELECT %s, %s FROM %s.%s", idcol, veccol, db, table);
+  int    partidx = 0, docidx = 0, ncols = 2;
+  string selectlist = string(idcol) + ", " + string(veccol);
+  if (partcol.length()) {
+    selectlist += ", " + partcol;
+    partidx = ncols++;
+  }
+  if (doccol.length()) {
+    selectlist += ", " + doccol;
+    docidx = ncols++;
+  }
+  snprintf(query, sizeof(query), "SELECT %s FROM %s.%s", selectlist.c_str(), db, table);
 
   /// table has been locked, now we perform the timestamp related stuff
   unsigned long current_ts  = time(NULL);
 
+  char whereClause[1024] = "";
   if (!strcmp(action, "refresh") || strlen(trackingColumn))
   {
-    char whereClause[1024];
-
-
     unsigned long previous_ts = vi->getUpdateTs();
     snprintf(whereClause, sizeof(whereClause), " WHERE unix_timestamp(%s) > %lu AND unix_timestamp(%s) <= %lu",
              trackingColumn, previous_ts, trackingColumn, current_ts);
-    strcat(query, whereClause);
   }
 
   vi->setUpdateTs(current_ts);
 
-  fprintf(stderr, "Final Build Query : %s\n", query);
+  string where = whereClause;
+  if (bo.resume) /// rows till resumeKey are in the partial build
+    where += (where.length() ? " AND " : " WHERE ") + string(idcol) + " > " +
+             to_string(bo.resumeKey);
+
+  /* Snapshot builds and refresh are not resumable */
+  bool resumable = (!snapshot && strcmp(action, "refresh") &&
+                    vi->supportsResumableBuild());
+
+  /* The table is locked, partial builds have its rows as of this position */
+  string stateBinlogFile;
+  size_t stateBinlogPos = 0;
+  if (resumable &&
+      !GetBinlogPosition(&mysql, stateBinlogFile, stateBinlogPos, errorbuf)) {
+    warning_print("Vector index %s.%s.%s : %s Partial builds are not saved.",
+                  db, table, veccol, errorbuf);
+    strcpy(errorbuf, "SUCCESS");
+    resumable = false;
+  }
 
-  if (mysql_real_query(&mysql, query, strlen(query))) {
-    //TODO
+  fprintf(stderr, "Final Build Query : %s%s (threads %d)\n", query, where.c_str(), nthreads);
+
+  auto startTime = chrono::steady_clock::now();
+
+  /* Scan sessions - the serial scan of a locked table uses this connection */
+  bool  parallel = (nthreads >= 2 && vi->supportsConcurrentUpdates());
+  int   nconns   = (parallel ? nthreads : (snapshot ? 1 : 0));
+  unique_ptr<MYSQL[]> conns(new MYSQL[std::max(nconns, 1)]);
+  if (nconns && !OpenBuildSessions(conns.get(), nconns, snapshot, errorbuf)) {
+    mysql_close(&mysql);
+    return false;
   }
 
-  MYSQL_RES *result = mysql_store_result(&mysql);
+  string vecid = string(db) + "." + string(table) + "." + string(veccol);
+
+  size_t totalRows = GetTableRowsEstimate(&mysql, db, table);
+  BuildProgressGuard progress(vecid, vi, totalRows);
+
+  shared_ptr<SnapshotBuild> sb;
+  if (snapshot) {
+    /* No DML on the table while it is locked, so the snapshot has all
+     * the events of the table till the current binlog position.
+     */
+    sb = make_shared<SnapshotBuild>();
+    sb->shadow = (replaces != nullptr);
+    if (!GetBinlogPosition(&mysql, sb->binlogFile, sb->binlogPos, errorbuf)) {
+      CloseBuildSessions(conns.get(), nconns);
+      mysql_close(&mysql);
+      return false;
+    }
+    {
+      lock_guard<mutex> l(g_SnapshotBuildsMutex);
+      g_SnapshotBuilds[vecid] = sb;
+    }
+    {
+      lock_guard<mutex> binlogMutex(binlog_stream_mutex_);
+      RegisterOnlineVectorIndex(&mysql, db, table, idcol, veccol, partcol, doccol);
+    }
 
-  MYSQL_ROW row;
+    const char *unlock = "UNLOCK TABLES";
+    if (mysql_real_query(&mysql, unlock, strlen(unlock))) {
+      snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in unlocking table %s.",
+               mysql_error(&mysql));
+      EndSnapshotBuild(vecid);
+      CloseBuildSessions(conns.get(), nconns);
+      mysql_close(&mysql);
+      return false;
+    }
+    fprintf(stderr, "Snapshot build at binlog position (%s %lu)\n",
+            sb->binlogFile.c_str(), sb->binlogPos);
+  }
 
-  while ((row = mysql_fetch_row(result)))
-  {
-    unsigned long *lengths;
-    lengths = mysql_fetch_lengths(result);
+  /* Key segments of the scan, one segment if the build is not resumable */
+  long long minid = 0, maxid = 0;
+  bool      empty = false;
+  unsigned long long segments = 1, width = 0;
+  bool scanned = true;
+  if (parallel || resumable)
+    scanned = GetKeyRange((nconns ? &conns[0] : &mysql), query, where, idcol,
+                          minid, maxid, empty, errorbuf);
+  if (scanned && !empty && resumable) {
+    segments = totalRows / MYVECTOR_BUILD_SEGMENT_ROWS + 1;
+    width    = KeyRangeWidth(minid, maxid, segments);
+  }
 
+  auto lastStateTime = chrono::steady_clock::now();
+  unsigned long failedSaves = 0;
+  for (unsigned long long seg = 0; scanned && !empty && seg < segments; seg++) {
+    long long lo = minid, hi = maxid;
+    string    segwhere = where;
+    if (resumable) {
+      if (!KeyRangeBounds(minid, maxid, width, seg, segments, lo, hi))
+        continue;
+      segwhere += (where.length() ? " AND " : " WHERE ") + string(idcol) +
+                  " BETWEEN " + to_string(lo) + " AND " + to_string(hi);
+    }
 
-    char *idval = row[0];
-    char *vec   = row[1];
-    
-    if (!lengths[0] || !lengths[1] || !idval) {
-      //TODO
+    if (parallel)
+      scanned = ScanBaseTableParallel(conns.get(), vi, query, where, idcol, lo, hi,
+                                      partidx, docidx, nthreads, nRows, errorbuf);
+    else
+      scanned = ScanBaseTable((nconns ? &conns[0] : &mysql), vi,
+                              string(query) + segwhere, partidx, docidx,
+                              nRows, errorbuf);
+
+    auto now = chrono::steady_clock::now();
+    if (scanned && resumable && seg < segments - 1 &&
+        chrono::duration<double>(now - lastStateTime).count() >= MYVECTOR_BUILD_STATE_SECS) {
+      if (!vi->saveBuildState(myvector_index_dir, (KeyTypeInteger)hi,
+                              stateBinlogFile, stateBinlogPos)) {
+        failedSaves = progress.saveFailed();
+        warning_print("Vector index %s : partial build not saved at key %lld, "
+                      "a failed build resumes from the previous save.",
+                      vecid.c_str(), hi);
+      }
+      lastStateTime = now;
     }
+  }
+  CloseBuildSessions(conns.get(), nconns);
 
-    vi->insertVector(vec, 0, atol(idval)); /// dim is already known by vi
-    nRows++;
+  if (!scanned) {
+    if (sb)
+      EndSnapshotBuild(vecid);
+    mysql_close(&mysql);
+    return false;
   }
 
-  mysql_free_result(result);
+  if (sb)
+    nEvents = CatchUpSnapshotBuild(vi.get(), sb.get());
+
+  double secs = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+  unsigned long rate = (secs > 0 ? (unsigned long)(nRows / secs) : nRows);
+  vi->setBuildStats(nRows, secs);
 
   // Get binlog coordinates, set checkpoint id and flush
 
+  bool built = true;
   {
 
     lock_guard<mutex> binlogMutex(binlog_stream_mutex_);
 
-    vi->setLastUpdateCoordinates(currentBinlogFile, currentBinlogPos);
+    string binlogFile = currentBinlogFile;
+    size_t binlogPos  = currentBinlogPos;
+
+    /* Snapshot build - the last held events, binlog events are applied to
+     * the open index after 'held' is released. The index is saved at the
+     * snapshot position, recovery applies the events after it again.
+     */
+    unique_lock<mutex> held;
+    if (sb) {
+      held = unique_lock<mutex>(sb->m);
+      nEvents += ApplySnapshotBuildEvents(vi.get(), sb->items);
+      binlogFile = sb->binlogFile;
+      binlogPos  = sb->binlogPos;
+    }
+
+    vi->setLastUpdateCoordinates(binlogFile, binlogPos);
 
     snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "SUCCESS: Index created & saved at (%s %lu)"
-             ", rows : %lu.", currentBinlogFile.c_str(), currentBinlogPos, nRows);
+             ", rows : %lu (%lu rows/sec), binlog events : %lu%s.", binlogFile.c_str(),
+             binlogPos, nRows, rate, nEvents,
+             (failedSaves ? (", partial saves failed : " + to_string(failedSaves)).c_str() : ""));
+
+    vi->saveIndex(myvector_index_dir, "build_reorder");
+    vi->dropBuildState(myvector_index_dir);
+
+    /* Shadow build - queries and binlog updates move to the new index here,
+     * before the next checkpoint of the old index could write its files.
+     */
+    if (replaces && !myvector_replace_index(replaces, vi)) {
+      snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Vector index was dropped during build"
+               ", rows : %lu.", nRows);
+      vi->dropIndex(myvector_index_dir);
+      built = false;
+    }
 
-    vi->saveIndex(myvector_index_dir, "build");
+    if (sb) {
+      sb->done = true;
+    }
+    else {
+      if (built && vi->supportsIncrUpdates())
+        RegisterOnlineVectorIndex(&mysql, db, table, idcol, veccol, partcol, doccol);
 
-    string key = string(db) + "." + string(table);
+      sprintf(query, "UNLOCK TABLES");
 
-    if (vi->supportsIncrUpdates()) {
-      int idcolpos = 0, veccolpos = 0;
-      GetBaseTableColumnPositions(&mysql, db, table, idcol, veccol,
-                                idcolpos, veccolpos);
-      VectorIndexColumnInfo vc{veccol, idcolpos, veccolpos};
-      g_OnlineVectorIndexes[key] = vc;
+      int ret = 0;
+      if ((ret = mysql_real_query(&mysql, query, strlen(query)))) {
+        snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in unlocking table (%d) %s.",
+                 ret, mysql_error(&mysql));
+      }
     }
-  
-    sprintf(query, "UNLOCK TABLES");
 
-    int ret = 0;
-    if ((ret = mysql_real_query(&mysql, query, strlen(query)))) {
-      snprintf(errorbuf, MYVECTOR_BUFF_SIZE, "Error in unlocking table (%d) %s.",
-               ret, mysql_error(&mysql));
-    } 
-  
   } // scope guard for binlog mutex lock
 
+  if (sb)
+    EndSnapshotBuild(vecid);
+
 exitFn:
   mysql_close(&mysql);
- 
+  return built;
 }
 
 void myvector_checkpoint_index(const string &dbtable, const string &veccol,
@@ -750,6 +1697,8 @@ void myvector_binlog_loop(int id) {
 
 
      if (type == binary_log::ROTATE_EVENT) {
+       /* serialized with the save & swap at the end of a (shadow) build */
+       lock_guard<mutex> binlogMutex(binlog_stream_mutex_);
        if (currentBinlogFile.length()) {
          FlushOnlineVectorIndexes();
        }
@@ -770,8 +1719,11 @@ void myvector_binlog_loop(int id) {
        }
        int idcolpos  = g_OnlineVectorIndexes[key].idColumnPosition;
        int veccolpos = g_OnlineVectorIndexes[key].vecColumnPosition;
+       int partcolpos = g_OnlineVectorIndexes[key].partColumnPosition;
+       int doccolpos  = g_OnlineVectorIndexes[key].docColumnPosition;
        vector<VectorIndexUpdateItem *> updates;
-       parseRowsEvent(event_buf, event_len, tev, idcolpos - 1, veccolpos - 1, updates);
+       parseRowsEvent(event_buf, event_len, tev, idcolpos - 1, veccolpos - 1,
+                      partcolpos - 1, doccolpos - 1, updates);
        nrows += updates.size();
        for (auto item : updates) {
          gqueue_.enqueue(item);
@@ -791,9 +1743,12 @@ void vector_q_thread_fn(int id)
 
   while (1) {
        item = gqueue_.dequeue();
+       if (HoldSnapshotBuildEvent(item))
+         continue; /// applied by the snapshot build
        myvector_table_op(item->dbName_, item->tableName_, item->columnName_,
                          item->pkid_, item->vec_,
-                         item->binlogFile_, item->binlogPos_);
+                         item->binlogFile_, item->binlogPos_,
+                         item->partition_, item->docid_);
        delete item;
   }
 
@@ -71,6 +71,7 @@ long myvector_feature_level;
 long myvector_index_bg_threads;
 char *myvector_index_dir;
 char *myvector_config_file;
+bool myvector_verify_checksum;
 
 static MYSQL_SYSVAR_LONG(
     feature_level, myvector_feature_level, PLUGIN_VAR_RQCMDARG,
@@ -94,8 +95,15 @@ static MYSQL_SYSVAR_STR(
     "MyVector config file.",
     nullptr, nullptr, "myvector.cnf");
 
+static MYSQL_SYSVAR_BOOL(
+    verify_checksum, myvector_verify_checksum, PLUGIN_VAR_OPCMDARG,
+    "Verify the checksum of vectors in myvector_display(). "
+    "myvector_is_valid() always verifies.",
+    nullptr, nullptr, true);
+
 static SYS_VAR * myvector_system_variables[] = {
-    MYSQL_SYSVAR(feature_level), MYSQL_SYSVAR(index_bg_threads), MYSQL_SYSVAR(index_dir), MYSQL_SYSVAR(config_file), nullptr};
+    MYSQL_SYSVAR(feature_level), MYSQL_SYSVAR(index_bg_threads), MYSQL_SYSVAR(index_dir), MYSQL_SYSVAR(config_file),
+    MYSQL_SYSVAR(verify_checksum), nullptr};
 
 static int myvector_sql_preparse(MYSQL_THD, mysql_event_class_t event_class,
                        const void *event) {
@@ -44,6 +44,9 @@ ORDER BY db,tbl,col;
 DROP FUNCTION IF EXISTS myvector_construct;
 DROP FUNCTION IF EXISTS myvector_display;
 DROP FUNCTION IF EXISTS myvector_distance;
+DROP FUNCTION IF EXISTS myvector_l2;
+DROP FUNCTION IF EXISTS myvector_ip;
+DROP FUNCTION IF EXISTS myvector_cosine;
 DROP FUNCTION IF EXISTS myvector_row_distance;
 DROP FUNCTION IF EXISTS myvector_ann_set;
 DROP FUNCTION IF EXISTS myvector_is_valid;
@@ -54,14 +57,23 @@ DROP FUNCTION IF EXISTS myvector_search_open_udf;
 -- Return : Serialized sequence of native floats for storing in VARBINARY column
 CREATE FUNCTION myvector_construct RETURNS STRING SONAME 'myvector.so';
 
--- myvector_display(vector_col_expr  VARBINARY)
--- Return : Vector as human readable string e.g [0.002487210 -0.019822444..]
+-- myvector_display(vector_col_expr  VARBINARY [, options VARCHAR])
+-- Return : Vector as human readable string e.g [0.002487210, -0.019822444..]
+--          options : precision e.g '7', or 'o=text|json|space|base64[,prec=N|shortest]'
 CREATE FUNCTION myvector_display   RETURNS STRING SONAME 'myvector.so';
 
 -- myvector_distance(vec1 VARBINARY, vec2 VARBINARY, disttype VARCHAR)
--- Return : Computed distance between 2 vectors. disttype is 1 of L2/EUCLIDEAN/IP
+-- Return : Computed distance between 2 vectors. disttype is 1 of L2/EUCLIDEAN/IP/Cosine
+--          NULL if the vectors have different dimensions
 CREATE FUNCTION myvector_distance  RETURNS REAL   SONAME 'myvector.so';
 
+-- myvector_l2(vec1 VARBINARY, vec2 VARBINARY), myvector_ip(...), myvector_cosine(...)
+-- Return : myvector_distance() with that distance type, e.g for
+--          ORDER BY myvector_l2(veccol, myvector_construct('[...]')) LIMIT k
+CREATE FUNCTION myvector_l2        RETURNS REAL   SONAME 'myvector.so';
+CREATE FUNCTION myvector_ip        RETURNS REAL   SONAME 'myvector.so';
+CREATE FUNCTION myvector_cosine    RETURNS REAL   SONAME 'myvector.so';
+
 -- myvector_ann_set(veccol VARCHAR, options VARCHAR, searchvec VARCHAR/VARBINARY)
 -- Return : Comma separated list of IDs of nearest neighbours
 CREATE FUNCTION myvector_ann_set  RETURNS STRING  SONAME 'myvector.so';
@@ -81,6 +93,8 @@ CREATE FUNCTION myvector_search_open_udf RETURNS STRING  SONAME 'myvector.so';
 
 DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_BUILD;
 
+DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_RESUME;
+
 DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_REFRESH;
 
 DROP PROCEDURE IF EXISTS MYVECTOR_INDEX_DROP;
@@ -200,7 +214,7 @@ BEGIN
 END
 //
 
--- action is 'build', 'refresh', 'load', 'drop'
+-- action is 'build', 'resume', 'refresh', 'load', 'drop'
 CREATE PROCEDURE MYVECTOR_INDEX_BUILD(
 	IN myvectorcolumn VARCHAR(256),
 	IN pkidcolumn     VARCHAR(64))
@@ -213,6 +227,19 @@ BEGIN
 END
 //
 
+-- Continue a build that failed, from its last partial save
+CREATE PROCEDURE MYVECTOR_INDEX_RESUME(
+	IN myvectorcolumn VARCHAR(256),
+	IN pkidcolumn     VARCHAR(64))
+BEGIN
+        DECLARE extra   VARCHAR(1024);
+        SET extra = '';
+
+        CALL MYVECTOR_INDEX_INTERNAL(myvectorcolumn, pkidcolumn, 'resume', extra);
+
+END
+//
+
 DELIMITER ;
 
 
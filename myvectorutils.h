@@ -93,6 +93,135 @@ private:
     bool       m_valid;
 };
 
+/* BoundedQueue - blocking FIFO with a fixed capacity, for producer/consumer
+ * pipelines. push() waits while the queue is full so that producers cannot
+ * run ahead of the consumers. After close(), push() fails and pop() fails
+ * once the queue is empty.
+ */
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+
+    bool push(T && item)
+    {
+        unique_lock<mutex> l(m_mutex);
+        m_notFull.wait(l, [this] { return m_items.size() < m_capacity || m_closed; });
+        if (m_closed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T & item)
+    {
+        unique_lock<mutex> l(m_mutex);
+        m_notEmpty.wait(l, [this] { return m_items.size() || m_closed; });
+        if (m_items.empty())
+            return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> l(m_mutex);
+        m_closed = true;
+        m_notFull.notify_all();
+        m_notEmpty.notify_all();
+    }
+
+private:
+    size_t             m_capacity;
+    bool               m_closed{false};
+    deque<T>           m_items;
+    mutex              m_mutex;
+    condition_variable m_notFull;
+    condition_variable m_notEmpty;
+};
+
+/* WorkerPool - threads that live as long as the plugin and run background
+ * tasks e.g the inserts of index builds, so that a build does not start and
+ * join threads for every batch. The pool grows to the largest number of
+ * threads asked for with reserve(), it never shrinks. Tasks must not wait
+ * for tasks queued after them.
+ */
+class WorkerPool {
+public:
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> l(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (auto & t : m_threads)
+            t.join();
+    }
+
+    /* reserve - at least 'nthreads' threads in the pool */
+    void reserve(size_t nthreads)
+    {
+        lock_guard<mutex> l(m_mutex);
+        while (m_threads.size() < nthreads)
+            m_threads.emplace_back([this] { run(); });
+    }
+
+    size_t size()
+    {
+        lock_guard<mutex> l(m_mutex);
+        return m_threads.size();
+    }
+
+    /* submit - queue a task, the future has the exception thrown by it */
+    future<void> submit(function<void()> fn)
+    {
+        packaged_task<void()> task(std::move(fn));
+        future<void> f = task.get_future();
+        {
+            lock_guard<mutex> l(m_mutex);
+            if (m_threads.empty())
+                m_threads.emplace_back([this] { run(); });
+            m_tasks.push_back(std::move(task));
+        }
+        m_cv.notify_one();
+        return f;
+    }
+
+private:
+    void run()
+    {
+        while (1) {
+            packaged_task<void()> task;
+            {
+                unique_lock<mutex> l(m_mutex);
+                m_cv.wait(l, [this] { return m_tasks.size() || m_stop; });
+                if (m_stop)
+                    return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    vector<thread>                m_threads;
+    deque<packaged_task<void()>>  m_tasks;
+    bool                          m_stop{false};
+    mutex                         m_mutex;
+    condition_variable            m_cv;
+};
+
+/* myvector_worker_pool - the WorkerPool shared by all indexes */
+inline WorkerPool & myvector_worker_pool()
+{
+    static WorkerPool pool;
+    return pool;
+}
+
 #ifdef TODO
 /* Compare 2 binlog coordinates */
 int binlogPositionCompare(const std::string & file1, size_t pos1,
@@ -115,6 +115,7 @@ class MultiVectorInnerProductSpace : public BaseMultiVectorSpace<DOCIDTYPE> {
         else if (dim > 4)
             fstdistfunc_ = InnerProductDistanceSIMD4ExtResiduals;
 #endif
+        dim_ = dim;
         vector_size_ = dim * sizeof(float);
         data_size_ = vector_size_ + sizeof(DOCIDTYPE);
     }
@@ -273,4 +274,78 @@ class EpsilonSearchStopCondition : public BaseSearchStopCondition<dist_t> {
 
     ~EpsilonSearchStopCondition() {}
 };
+
+
+/* AdaptiveSearchStopCondition - k-NN search with an early exit. The search
+ * behaves as ef = max_num_candidates, but stops as soon as the k best
+ * distances have not improved for 'patience' node expansions. Easy queries
+ * converge early and stop, hard queries keep going up to the ef ceiling.
+ * 'patience' is calibrated per index for a recall target.
+ */
+template<typename dist_t>
+class AdaptiveSearchStopCondition : public BaseSearchStopCondition<dist_t> {
+    size_t k_;
+    size_t max_num_candidates_;
+    size_t patience_;
+    size_t curr_num_items_;
+    size_t num_stagnant_;
+    std::priority_queue<dist_t> best_k_;  // k best distances so far, farthest on top
+
+ public:
+    AdaptiveSearchStopCondition(size_t k, size_t max_num_candidates, size_t patience) {
+        k_ = k;
+        max_num_candidates_ = std::max(k, max_num_candidates);
+        patience_ = patience;
+        curr_num_items_ = 0;
+        num_stagnant_ = 0;
+    }
+
+    void add_point_to_result(labeltype /*label*/, const void * /*datapoint*/, dist_t dist) override {
+        curr_num_items_ += 1;
+        if (best_k_.size() < k_) {
+            best_k_.push(dist);
+            num_stagnant_ = 0;
+        } else if (dist < best_k_.top()) {
+            best_k_.pop();
+            best_k_.push(dist);
+            num_stagnant_ = 0;
+        }
+    }
+
+    void remove_point_from_result(labeltype /*label*/, const void * /*datapoint*/, dist_t /*dist*/) override {
+        curr_num_items_ -= 1;
+    }
+
+    bool should_stop_search(dist_t candidate_dist, dist_t lowerBound) override {
+        if (candidate_dist > lowerBound && curr_num_items_ == max_num_candidates_) {
+            // new candidate can't improve found results
+            return true;
+        }
+        // called once per node expansion
+        num_stagnant_ += 1;
+        if (best_k_.size() == k_ && num_stagnant_ > patience_) {
+            // top k has converged
+            return true;
+        }
+        return false;
+    }
+
+    bool should_consider_candidate(dist_t candidate_dist, dist_t lowerBound) override {
+        bool flag_consider_candidate = curr_num_items_ < max_num_candidates_ || lowerBound > candidate_dist;
+        return flag_consider_candidate;
+    }
+
+    bool should_remove_extra() override {
+        bool flag_remove_extra = curr_num_items_ > max_num_candidates_;
+        return flag_remove_extra;
+    }
+
+    void filter_results(std::vector<std::pair<dist_t, labeltype >> &candidates) override {
+        while (candidates.size() > k_) {
+            candidates.pop_back();
+        }
+    }
+
+    ~AdaptiveSearchStopCondition() {}
+};
 }  // namespace hnswlib
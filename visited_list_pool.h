@@ -1,33 +1,171 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <string.h>
+#include <stdint.h>
 #include <deque>
 
 namespace hnswlib {
 typedef unsigned short int vl_type;
 
+/* Indexes with more elements than this use sparse visited lists - a dense
+ * list costs 2 bytes x max_elements per concurrent search, while a search
+ * with a small ef only visits a few thousand elements.
+ */
+static const size_t VISITED_LIST_SPARSE_MIN_ELEMENTS = (1 << 22);
+
+/* Initial number of slots in a sparse visited list (power of 2) */
+static const size_t VISITED_LIST_SPARSE_INIT_SLOTS   = (1 << 12);
+
+/* Number of per-thread cache slots in a VisitedListPool (power of 2) */
+static const size_t VISITED_LIST_THREAD_SLOTS        = 256;
+
+/* VisitedList - set of elements visited by one search. Dense mode is the
+ * hnswlib array of tags indexed by element id. Sparse mode is an open
+ * addressing hash of element ids, with the same tag scheme so that reset()
+ * is O(1) in both modes. Use visit() so that code works with both modes,
+ * 'mass' and 'curV' are for hnswlib code that only uses dense lists.
+ */
 class VisitedList {
  public:
     vl_type curV;
     vl_type *mass;
     unsigned int numelements;
 
-    VisitedList(int numelements1) {
+    VisitedList(int numelements1, bool sparse = false,
+                std::atomic<size_t> *memory_counter = nullptr) {
         curV = -1;
         numelements = numelements1;
-        mass = new vl_type[numelements];
+        mass = nullptr;
+        keys_ = nullptr;
+        tags_ = nullptr;
+        count_ = 0;
+        memory_counter_ = memory_counter;
+        if (!sparse) {
+            mass = new vl_type[numelements];
+            addMemory(sizeof(vl_type) * numelements);
+        } else {
+            allocSparse(VISITED_LIST_SPARSE_INIT_SLOTS);
+        }
     }
 
     void reset() {
         curV++;
+        count_ = 0;
         if (curV == 0) {
-            memset(mass, 0, sizeof(vl_type) * numelements);
+            if (mass)
+                memset(mass, 0, sizeof(vl_type) * numelements);
+            else
+                memset(tags_, 0, sizeof(vl_type) * (mask_ + 1));
             curV++;
         }
     }
 
-    ~VisitedList() { delete[] mass; }
+    /* visit - mark 'id' as visited, returns true if it was already visited */
+    inline bool visit(unsigned int id) {
+        if (mass) {
+            if (mass[id] == curV)
+                return true;
+            mass[id] = curV;
+            return false;
+        }
+        return visitSparse(id);
+    }
+
+    /* slotAddress - address to prefetch before visit(id) */
+    inline const void *slotAddress(unsigned int id) const {
+        if (mass)
+            return (mass + id);
+        return (tags_ + slotOf(id));
+    }
+
+    bool isSparse() const { return mass == nullptr; }
+
+    size_t memoryUsage() const {
+        if (mass)
+            return sizeof(vl_type) * numelements;
+        return (sizeof(vl_type) + sizeof(unsigned int)) * (mask_ + 1);
+    }
+
+    ~VisitedList() {
+        subMemory(memoryUsage());
+        delete[] mass;
+        delete[] keys_;
+        delete[] tags_;
+    }
+
+ private:
+    /* sparse mode - slot is in use in this search if tags_[slot] == curV */
+    unsigned int *keys_;
+    vl_type      *tags_;
+    size_t        mask_;
+    size_t        shift_;
+    size_t        count_;
+    std::atomic<size_t> *memory_counter_;
+
+    inline size_t slotOf(unsigned int id) const {
+        return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> shift_) & mask_;
+    }
+
+    void addMemory(size_t bytes) {
+        if (memory_counter_)
+            (*memory_counter_) += bytes;
+    }
+
+    void subMemory(size_t bytes) {
+        if (memory_counter_)
+            (*memory_counter_) -= bytes;
+    }
+
+    void allocSparse(size_t nslots) {
+        keys_  = new unsigned int[nslots];
+        tags_  = new vl_type[nslots];
+        memset(tags_, 0, sizeof(vl_type) * nslots);
+        mask_  = nslots - 1;
+        shift_ = 64;
+        while (nslots > 1) {
+            nslots >>= 1;
+            shift_--;
+        }
+        addMemory(memoryUsage());
+    }
+
+    inline bool visitSparse(unsigned int id) {
+        size_t slot = slotOf(id);
+        while (tags_[slot] == curV) {
+            if (keys_[slot] == id)
+                return true;
+            slot = (slot + 1) & mask_;
+        }
+        tags_[slot] = curV;
+        keys_[slot] = id;
+        if (++count_ * 2 > mask_ + 1)
+            growSparse();
+        return false;
+    }
+
+    /* growSparse - double the slots, keep the elements of this search */
+    void growSparse() {
+        unsigned int *oldkeys  = keys_;
+        vl_type      *oldtags  = tags_;
+        size_t        oldslots = mask_ + 1;
+
+        subMemory(memoryUsage());
+        allocSparse(oldslots * 2);
+        for (size_t i = 0; i < oldslots; i++) {
+            if (oldtags[i] != curV)
+                continue;
+            size_t slot = slotOf(oldkeys[i]);
+            while (tags_[slot] == curV)
+                slot = (slot + 1) & mask_;
+            tags_[slot] = curV;
+            keys_[slot] = oldkeys[i];
+        }
+        delete[] oldkeys;
+        delete[] oldtags;
+    }
 };
 ///////////////////////////////////////////////////////////
 //
@@ -35,27 +173,44 @@ class VisitedList {
 //
 /////////////////////////////////////////////////////////
 
+/* Each thread has a cache slot in the pool, a list returned by a thread is
+ * kept in its slot and taken again by its next search without any lock. The
+ * mutex guarded deque is used only if two threads share a slot.
+ */
 class VisitedListPool {
     std::deque<VisitedList *> pool;
     std::mutex poolguard;
     int numelements;
+    bool sparse_;
+    std::atomic<size_t> memory_{0};
+    std::unique_ptr<std::atomic<VisitedList *>[]> slots_;
+
+    static size_t threadSlot() {
+        static std::atomic<size_t> next_slot{0};
+        thread_local size_t slot = next_slot++;
+        return slot & (VISITED_LIST_THREAD_SLOTS - 1);
+    }
 
  public:
-    VisitedListPool(int initmaxpools, int numelements1) {
+    VisitedListPool(int initmaxpools, int numelements1, bool sparse = false) {
         numelements = numelements1;
+        sparse_ = sparse;
+        slots_.reset(new std::atomic<VisitedList *>[VISITED_LIST_THREAD_SLOTS]);
+        for (size_t i = 0; i < VISITED_LIST_THREAD_SLOTS; i++)
+            slots_[i] = nullptr;
         for (int i = 0; i < initmaxpools; i++)
-            pool.push_front(new VisitedList(numelements));
+            pool.push_front(new VisitedList(numelements, sparse_, &memory_));
     }
 
     VisitedList *getFreeVisitedList() {
-        VisitedList *rez;
-        {
+        VisitedList *rez = slots_[threadSlot()].exchange(nullptr);
+        if (!rez) {
             std::unique_lock <std::mutex> lock(poolguard);
             if (pool.size() > 0) {
                 rez = pool.front();
                 pool.pop_front();
             } else {
-                rez = new VisitedList(numelements);
+                rez = new VisitedList(numelements, sparse_, &memory_);
             }
         }
         rez->reset();
@@ -63,16 +218,26 @@ class VisitedListPool {
     }
 
     void releaseVisitedList(VisitedList *vl) {
+        VisitedList *expected = nullptr;
+        if (slots_[threadSlot()].compare_exchange_strong(expected, vl))
+            return;
         std::unique_lock <std::mutex> lock(poolguard);
         pool.push_front(vl);
     }
 
+    /* memoryUsage - bytes held by all visited lists of this pool */
+    size_t memoryUsage() const { return memory_; }
+
+    bool isSparse() const { return sparse_; }
+
     ~VisitedListPool() {
         while (pool.size()) {
             VisitedList *rez = pool.front();
             pool.pop_front();
             delete rez;
         }
+        for (size_t i = 0; i < VISITED_LIST_THREAD_SLOTS; i++)
+            delete slots_[i].exchange(nullptr);
     }
 };
 }  // namespace hnswlib